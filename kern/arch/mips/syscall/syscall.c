@@ -30,7 +30,9 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/syscall.h>
+#include <endian.h>
 #include <lib.h>
+#include <copyinout.h>
 #include <mips/trapframe.h>
 #include <current.h>
 #include <addrspace.h>
@@ -79,6 +81,11 @@ void syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	int err = 0;
+#if OPT_FILE
+	off_t pos, retval64;
+	uint64_t pos64;
+	int whence;
+#endif
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -108,8 +115,63 @@ void syscall(struct trapframe *tf)
 						 (userptr_t)tf->tf_a1);
 		break;
 
+	case SYS_nanosleep:
+		err = sys_nanosleep((userptr_t)tf->tf_a0,
+							(userptr_t)tf->tf_a1);
+		break;
+
 		/* Add stuff here */
 #if OPT_SYSCALL
+#if OPT_FILE
+
+	case SYS_open:
+		err = sys_open((userptr_t)tf->tf_a0,
+					   (int)tf->tf_a1,
+					   (mode_t)tf->tf_a2,
+					   &retval);
+		break;
+
+	case SYS_close:
+		err = sys_close((int)tf->tf_a0);
+		break;
+
+	case SYS_write:
+		err = sys_write((int)tf->tf_a0,
+						(userptr_t)tf->tf_a1,
+						(size_t)tf->tf_a2,
+						&retval);
+		break;
+
+	case SYS_read:
+		err = sys_read((int)tf->tf_a0,
+					   (userptr_t)tf->tf_a1,
+					   (size_t)tf->tf_a2,
+					   &retval);
+		break;
+
+	case SYS_lseek:
+		/* fd in a0, 64-bit pos in a2/a3, whence on the stack */
+		join32to64(tf->tf_a2, tf->tf_a3, &pos64);
+		pos = pos64;
+		err = copyin((const_userptr_t)(tf->tf_sp + 16),
+					 &whence, sizeof(whence));
+		if (err)
+			break;
+		err = sys_lseek((int)tf->tf_a0, pos, whence, &retval64);
+		if (err)
+			break;
+		/* 64-bit return value in v0/v1 */
+		split64to32(retval64, &tf->tf_v0, &tf->tf_v1);
+		retval = tf->tf_v0;
+		break;
+
+	case SYS_dup2:
+		err = sys_dup2((int)tf->tf_a0,
+					   (int)tf->tf_a1,
+					   &retval);
+		break;
+
+#else
 
 	case SYS_write:
 		retval = sys_write((int)tf->tf_a0,
@@ -132,6 +194,7 @@ void syscall(struct trapframe *tf)
 		else
 			err = 0;
 		break;
+#endif
 
 	case SYS__exit:
 		/* TODO: just avoid crash */
@@ -156,6 +219,11 @@ void syscall(struct trapframe *tf)
 			err = 0;
 		break;
 
+	case SYS_execv:
+		err = sys_execv((userptr_t)tf->tf_a0,
+						(userptr_t)tf->tf_a1);
+		break;
+
 #if OPT_FORK
 	case SYS_fork:
 		err = sys_fork(tf, &retval);
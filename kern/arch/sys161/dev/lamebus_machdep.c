@@ -128,6 +128,19 @@ mainbus_start_cpus(void)
 	lamebus_start_cpus(lamebus);
 }
 
+/*
+ * Turn the current cpu's hardclock off or on. The on-chip timer
+ * can't actually be stopped, so "off" sets it to the longest period
+ * it has (almost three minutes). The interrupt handler re-arms it
+ * the same way, so a tick that does arrive on an idle cpu leaves it
+ * off.
+ */
+void
+mainbus_set_hardclock(bool enable)
+{
+	mips_timer_set(enable ? CPU_FREQUENCY / HZ : 0xffffffff);
+}
+
 /*
  * Function to generate the memory address (in the uncached segment)
  * for the specified offset into the specified slot's region of the
@@ -314,8 +327,11 @@ mainbus_interrupt(struct trapframe *tf)
 		seen = true;
 	}
 	if (cause & MIPS_TIMER_BIT) {
-		/* Reset the timer (this clears the interrupt) */
-		mips_timer_set(CPU_FREQUENCY / HZ);
+		/*
+		 * Reset the timer (this clears the interrupt), keeping
+		 * it off if this cpu has gone tickless.
+		 */
+		mainbus_set_hardclock(!curcpu->c_tickless);
 		/* and call hardclock */
 		hardclock();
 		seen = true;
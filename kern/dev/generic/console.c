@@ -39,6 +39,13 @@
  * supported, although such support could be added without undue
  * difficulty.
  *
+ * Output in interrupt mode goes through a transmit ring (see
+ * <generic/console.h>): writers copy whole buffers into it and only
+ * sleep if it is full, and the write-done interrupt feeds the device
+ * one character at a time from it. Input is collected by the
+ * read-ready interrupt into a receive ring; user reads wait for a
+ * complete line (or a full ring) and take it all at once.
+ *
  * Note that nothing happens until we have a device to write to. A
  * buffer of size DELAYBUFSIZE is used to hold output that is
  * generated before this point. This means that (1) using kprintf for
@@ -55,6 +62,7 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
@@ -72,6 +80,11 @@ static struct con_softc *the_console = NULL;
 static struct lock *con_userlock_read = NULL;
 static struct lock *con_userlock_write = NULL;
 
+/*
+ * Size of the bounce buffer con_io uses to move user data.
+ */
+#define CON_IOCHUNK 128
+
 //////////////////////////////////////////////////
 
 /*
@@ -112,16 +125,100 @@ flush_delay_buf(void)
 /*
  * Print a character, using polling instead of interrupts to wait for
  * I/O completion.
+ *
+ * Anything still queued in the transmit ring is pushed out first, so
+ * polled output (panics, the shutdown messages) neither overtakes
+ * nor strands earlier interrupt-mode output.
+ *
+ * This can run in an interrupt handler or with other spinlocks held,
+ * so it doesn't wake writers waiting for room in the ring; the ring
+ * was busy, so the write-done interrupt comes along and does that.
+ * It only takes the ring lock if this CPU holds no other spinlock
+ * (holding the ring lock, we would be underneath con_write or
+ * con_start and must leave the ring alone; holding another, waiting
+ * for the ring lock could deadlock against con_start waking a
+ * thread). During a panic the other CPUs are stopped, maybe while
+ * holding the lock, so drain the ring without it.
  */
 static
 void
 putch_polled(struct con_softc *cs, int ch)
 {
+	bool dolock;
+
+	if (cs->cs_txhead != cs->cs_txtail &&
+	    (panicking || curcpu->c_spinlocks == 0)) {
+		dolock = !panicking;
+		if (dolock) {
+			spinlock_acquire(&cs->cs_txlock);
+		}
+		while (cs->cs_txhead != cs->cs_txtail) {
+			cs->cs_sendpolled(cs->cs_devdata,
+					  cs->cs_txbuf[cs->cs_txtail]);
+			cs->cs_txtail = (cs->cs_txtail + 1)
+				% CONSOLE_OUTPUT_BUFFER_SIZE;
+		}
+		if (dolock) {
+			spinlock_release(&cs->cs_txlock);
+		}
+	}
 	cs->cs_sendpolled(cs->cs_devdata, ch);
 }
 
 //////////////////////////////////////////////////
 
+/*
+ * Start the device on the next character in the transmit ring, or
+ * note that it has gone idle. Call with cs_txlock held.
+ */
+static
+void
+con_txkick(struct con_softc *cs)
+{
+	unsigned char ch;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_txlock));
+
+	if (cs->cs_txhead == cs->cs_txtail) {
+		cs->cs_txbusy = false;
+		return;
+	}
+	ch = cs->cs_txbuf[cs->cs_txtail];
+	cs->cs_txtail = (cs->cs_txtail + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+	cs->cs_txbusy = true;
+	cs->cs_send(cs->cs_devdata, ch);
+}
+
+/*
+ * Queue LEN bytes for output, using interrupts to wait for I/O
+ * completion. Sleeps only while the ring is full.
+ */
+static
+void
+con_write(struct con_softc *cs, const char *buf, size_t len)
+{
+	unsigned nexthead;
+
+	spinlock_acquire(&cs->cs_txlock);
+	while (len > 0) {
+		nexthead = (cs->cs_txhead + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+		if (nexthead == cs->cs_txtail) {
+			/* full; the device must be busy draining it */
+			KASSERT(cs->cs_txbusy);
+			wchan_sleep(cs->cs_txwchan, &cs->cs_txlock);
+			continue;
+		}
+		cs->cs_txbuf[cs->cs_txhead] = *buf++;
+		cs->cs_txhead = nexthead;
+		len--;
+
+		if (!cs->cs_txbusy) {
+			con_txkick(cs);
+		}
+	}
+	spinlock_release(&cs->cs_txlock);
+}
+
 /*
  * Print a character, using interrupts to wait for I/O completion.
  */
@@ -129,8 +226,40 @@ static
 void
 putch_intr(struct con_softc *cs, int ch)
 {
-	P(cs->cs_wsem);
-	cs->cs_send(cs->cs_devdata, ch);
+	char c = ch;
+
+	con_write(cs, &c, 1);
+}
+
+/*
+ * Receive ring helpers. Call with cs_rxlock held.
+ *
+ * Note: if gotchars_head == gotchars_tail, the buffer is empty. Thus
+ * if gotchars_head+1 == gotchars_tail, the buffer is full.
+ */
+static
+bool
+con_rxfull(struct con_softc *cs)
+{
+	return (cs->cs_gotchars_head + 1) % CONSOLE_INPUT_BUFFER_SIZE
+		== cs->cs_gotchars_tail;
+}
+
+static
+unsigned char
+con_rxtake(struct con_softc *cs)
+{
+	unsigned char ch;
+
+	KASSERT(cs->cs_gotchars_head != cs->cs_gotchars_tail);
+	ch = cs->cs_gotchars[cs->cs_gotchars_tail];
+	cs->cs_gotchars_tail =
+		(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
+	if (ch=='\r' || ch=='\n') {
+		KASSERT(cs->cs_gotlines > 0);
+		cs->cs_gotlines--;
+	}
+	return ch;
 }
 
 /*
@@ -142,38 +271,39 @@ getch_intr(struct con_softc *cs)
 {
 	unsigned char ret;
 
-	P(cs->cs_rsem);
-	ret = cs->cs_gotchars[cs->cs_gotchars_tail];
-	cs->cs_gotchars_tail =
-		(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
+	spinlock_acquire(&cs->cs_rxlock);
+	while (cs->cs_gotchars_head == cs->cs_gotchars_tail) {
+		wchan_sleep(cs->cs_rxwchan, &cs->cs_rxlock);
+	}
+	ret = con_rxtake(cs);
+	spinlock_release(&cs->cs_rxlock);
 	return ret;
 }
 
 /*
  * Called from underlying device when a read-ready interrupt occurs.
- *
- * Note: if gotchars_head == gotchars_tail, the buffer is empty. Thus
- * if gotchars_head+1 == gotchars_tail, the buffer is full. A slightly
- * tidier way to implement this check (that avoids wasting a slot,
- * too) would be with a second semaphore used with a nonblocking P,
- * but we don't have that in OS/161.
  */
 void
 con_input(void *vcs, int ch)
 {
 	struct con_softc *cs = vcs;
-	unsigned nexthead;
 
-	nexthead = (cs->cs_gotchars_head + 1) % CONSOLE_INPUT_BUFFER_SIZE;
-	if (nexthead == cs->cs_gotchars_tail) {
+	spinlock_acquire(&cs->cs_rxlock);
+	if (con_rxfull(cs)) {
 		/* overflow; drop character */
+		spinlock_release(&cs->cs_rxlock);
 		return;
 	}
 
 	cs->cs_gotchars[cs->cs_gotchars_head] = ch;
-	cs->cs_gotchars_head = nexthead;
+	cs->cs_gotchars_head =
+		(cs->cs_gotchars_head + 1) % CONSOLE_INPUT_BUFFER_SIZE;
+	if (ch=='\r' || ch=='\n') {
+		cs->cs_gotlines++;
+	}
 
-	V(cs->cs_rsem);
+	wchan_wakeall(cs->cs_rxwchan, &cs->cs_rxlock);
+	spinlock_release(&cs->cs_rxlock);
 }
 
 /*
@@ -184,7 +314,10 @@ con_start(void *vcs)
 {
 	struct con_softc *cs = vcs;
 
-	V(cs->cs_wsem);
+	spinlock_acquire(&cs->cs_txlock);
+	con_txkick(cs);
+	wchan_wakeall(cs->cs_txwchan, &cs->cs_txlock);
+	spinlock_release(&cs->cs_txlock);
 }
 
 //////////////////////////////////////////////////
@@ -215,6 +348,28 @@ putch(int ch)
 	}
 }
 
+/*
+ * Print a buffer. Same rules as putch, but in interrupt mode the
+ * whole buffer goes into the transmit ring in one go.
+ */
+void
+putbuf(const char *buf, size_t len)
+{
+	struct con_softc *cs = the_console;
+	size_t i;
+
+	if (cs != NULL &&
+	    !curthread->t_in_interrupt &&
+	    curthread->t_curspl == 0 &&
+	    curcpu->c_spinlocks == 0) {
+		con_write(cs, buf, len);
+		return;
+	}
+	for (i=0; i<len; i++) {
+		putch(buf[i]);
+	}
+}
+
 int
 getch(void)
 {
@@ -240,16 +395,93 @@ con_eachopen(struct device *dev, int openflags)
 	return 0;
 }
 
+/*
+ * Read up to a line. We wait until the receive ring holds a complete
+ * line, or is full (then the partial line is returned, as there is
+ * nowhere for the rest to go), and take it out a chunk at a time.
+ */
+static
+int
+con_read(struct con_softc *cs, struct uio *uio)
+{
+	char kbuf[CON_IOCHUNK];
+	size_t n;
+	bool eol = false;
+	int result;
+
+	while (uio->uio_resid > 0 && !eol) {
+		spinlock_acquire(&cs->cs_rxlock);
+		while (cs->cs_gotlines == 0 && !con_rxfull(cs)) {
+			wchan_sleep(cs->cs_rxwchan, &cs->cs_rxlock);
+		}
+		n = 0;
+		while (n < sizeof(kbuf) && n < uio->uio_resid &&
+		       cs->cs_gotchars_head != cs->cs_gotchars_tail) {
+			kbuf[n] = con_rxtake(cs);
+			if (kbuf[n]=='\r') {
+				kbuf[n] = '\n';
+			}
+			if (kbuf[n++]=='\n') {
+				eol = true;
+				break;
+			}
+		}
+		spinlock_release(&cs->cs_rxlock);
+
+		result = uiomove(kbuf, n, uio);
+		if (result) {
+			return result;
+		}
+		if (n < sizeof(kbuf)) {
+			/* line done, request done, or ring drained */
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write the whole uio: copy it in a chunk at a time, expand newlines,
+ * and queue each chunk on the transmit ring.
+ */
+static
+int
+con_writeuio(struct con_softc *cs, struct uio *uio)
+{
+	char kbuf[CON_IOCHUNK];
+	char obuf[2*CON_IOCHUNK];
+	size_t n, i, olen;
+	int result;
+
+	while (uio->uio_resid > 0) {
+		n = uio->uio_resid;
+		if (n > sizeof(kbuf)) {
+			n = sizeof(kbuf);
+		}
+		result = uiomove(kbuf, n, uio);
+		if (result) {
+			return result;
+		}
+		olen = 0;
+		for (i=0; i<n; i++) {
+			if (kbuf[i]=='\n') {
+				obuf[olen++] = '\r';
+			}
+			obuf[olen++] = kbuf[i];
+		}
+		con_write(cs, obuf, olen);
+	}
+	return 0;
+}
+
 static
 int
 con_io(struct device *dev, struct uio *uio)
 {
+	struct con_softc *cs = dev->d_data;
 	int result;
-	char ch;
 	struct lock *lk;
 
-	(void)dev;  // unused
-
 	if (uio->uio_rw==UIO_READ) {
 		lk = con_userlock_read;
 	}
@@ -259,36 +491,14 @@ con_io(struct device *dev, struct uio *uio)
 
 	KASSERT(lk != NULL);
 	lock_acquire(lk);
-
-	while (uio->uio_resid > 0) {
-		if (uio->uio_rw==UIO_READ) {
-			ch = getch();
-			if (ch=='\r') {
-				ch = '\n';
-			}
-			result = uiomove(&ch, 1, uio);
-			if (result) {
-				lock_release(lk);
-				return result;
-			}
-			if (ch=='\n') {
-				break;
-			}
-		}
-		else {
-			result = uiomove(&ch, 1, uio);
-			if (result) {
-				lock_release(lk);
-				return result;
-			}
-			if (ch=='\n') {
-				putch('\r');
-			}
-			putch(ch);
-		}
+	if (uio->uio_rw==UIO_READ) {
+		result = con_read(cs, uio);
+	}
+	else {
+		result = con_writeuio(cs, uio);
 	}
 	lock_release(lk);
-	return 0;
+	return result;
 }
 
 static
@@ -343,7 +553,7 @@ attach_console_to_vfs(struct con_softc *cs)
 int
 config_con(struct con_softc *cs, int unit)
 {
-	struct semaphore *rsem, *wsem;
+	struct wchan *rxwchan, *txwchan;
 	struct lock *rlk, *wlk;
 
 	/*
@@ -359,33 +569,39 @@ config_con(struct con_softc *cs, int unit)
 	}
 	KASSERT(the_console==NULL);
 
-	rsem = sem_create("console read", 0);
-	if (rsem == NULL) {
+	rxwchan = wchan_create("console read");
+	if (rxwchan == NULL) {
 		return ENOMEM;
 	}
-	wsem = sem_create("console write", 1);
-	if (wsem == NULL) {
-		sem_destroy(rsem);
+	txwchan = wchan_create("console write");
+	if (txwchan == NULL) {
+		wchan_destroy(rxwchan);
 		return ENOMEM;
 	}
 	rlk = lock_create("console-lock-read");
 	if (rlk == NULL) {
-		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(rxwchan);
+		wchan_destroy(txwchan);
 		return ENOMEM;
 	}
 	wlk = lock_create("console-lock-write");
 	if (wlk == NULL) {
 		lock_destroy(rlk);
-		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(rxwchan);
+		wchan_destroy(txwchan);
 		return ENOMEM;
 	}
 
-	cs->cs_rsem = rsem;
-	cs->cs_wsem = wsem;
+	spinlock_init(&cs->cs_rxlock);
+	cs->cs_rxwchan = rxwchan;
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
+	cs->cs_gotlines = 0;
+	spinlock_init(&cs->cs_txlock);
+	cs->cs_txwchan = txwchan;
+	cs->cs_txhead = 0;
+	cs->cs_txtail = 0;
+	cs->cs_txbusy = false;
 
 	the_console = cs;
 	con_userlock_read = rlk;
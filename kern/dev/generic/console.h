@@ -30,6 +30,8 @@
 #ifndef _GENERIC_CONSOLE_H_
 #define _GENERIC_CONSOLE_H_
 
+#include <spinlock.h>
+
 /*
  * Device data for the hardware-independent system console.
  *
@@ -37,7 +39,8 @@
  * device, and are to be initialized by the attach routine.
  */
 
-#define CONSOLE_INPUT_BUFFER_SIZE 32
+#define CONSOLE_INPUT_BUFFER_SIZE 256
+#define CONSOLE_OUTPUT_BUFFER_SIZE 1024
 
 struct con_softc {
 	/* initialized by attach routine */
@@ -46,11 +49,31 @@ struct con_softc {
 	void (*cs_sendpolled)(void *devdata, int ch);
 
 	/* initialized by config routine */
-	struct semaphore *cs_rsem;
-	struct semaphore *cs_wsem;
+
+	/*
+	 * Receive ring, filled by the read-ready interrupt
+	 * (con_input). cs_gotlines counts the line ends in it, so
+	 * readers can wait for a whole line and take it in one pass.
+	 */
+	struct spinlock cs_rxlock;
+	struct wchan *cs_rxwchan;	/* readers waiting for input */
 	unsigned char cs_gotchars[CONSOLE_INPUT_BUFFER_SIZE];
 	unsigned cs_gotchars_head;	/* next slot to put a char in */
 	unsigned cs_gotchars_tail;	/* next slot to take a char out */
+	unsigned cs_gotlines;		/* complete lines in the ring */
+
+	/*
+	 * Transmit ring. Writers append under cs_txlock; the
+	 * write-done interrupt (con_start) sends the next character.
+	 * cs_txbusy is true while the device has a character in
+	 * flight, i.e. while an interrupt is still coming.
+	 */
+	struct spinlock cs_txlock;
+	struct wchan *cs_txwchan;	/* writers waiting for ring space */
+	unsigned char cs_txbuf[CONSOLE_OUTPUT_BUFFER_SIZE];
+	unsigned cs_txhead;		/* next slot to put a char in */
+	unsigned cs_txtail;		/* next slot to take a char out */
+	bool cs_txbusy;
 };
 
 /*
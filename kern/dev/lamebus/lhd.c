@@ -36,7 +36,7 @@
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -96,15 +96,209 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Start the next sector of the active request: for writes, load the
+ * on-card buffer first. Call with lh_lock held.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh)
+{
+	struct lhd_request *req = lh->lh_active;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(req != NULL);
+	KASSERT(req->lr_done < req->lr_nsect);
+
+	if (req->lr_iswrite) {
+		memcpy(lh->lh_buf, req->lr_buf + req->lr_done*LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+
+	lh->lh_headpos = req->lr_sector + req->lr_done + 1;
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, req->lr_sector + req->lr_done);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Choose the next request to run and take it off the queue: the
+ * oldest one if its deadline has passed, otherwise the first one at
+ * or above the head position, otherwise (wrapping around) the lowest.
+ * Call with lh_lock held.
+ */
+static
+struct lhd_request *
+lhd_pick(struct lhd_softc *lh)
+{
+	struct lhd_request *req, **pp, **best, **lowest;
+
+	if (lh->lh_queue == NULL) {
+		return NULL;
+	}
+
+	if ((int)(lh->lh_dispatches - lh->lh_queue->lr_deadline) >= 0) {
+		best = &lh->lh_queue;
+	}
+	else {
+		best = lowest = NULL;
+		for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next) {
+			req = *pp;
+			if (lowest == NULL ||
+			    req->lr_sector < (*lowest)->lr_sector) {
+				lowest = pp;
+			}
+			if (req->lr_sector >= lh->lh_headpos &&
+			    (best == NULL ||
+			     req->lr_sector < (*best)->lr_sector)) {
+				best = pp;
+			}
+		}
+		if (best == NULL) {
+			best = lowest;
+		}
+	}
+
+	req = *best;
+	*best = req->lr_next;
+	req->lr_next = NULL;
+	return req;
+}
+
+/*
+ * If the device is idle, start the next request. Call with lh_lock
+ * held.
+ */
+static
+void
+lhd_dispatch(struct lhd_softc *lh)
+{
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_active != NULL) {
+		return;
+	}
+	lh->lh_active = lhd_pick(lh);
+	if (lh->lh_active != NULL) {
+		lh->lh_dispatches++;
+		lhd_start(lh);
+	}
+}
+
+/*
+ * Record that a sector has completed. Either start the next sector
+ * of the same request, or finish the request, notify its owner, and
+ * move on to the next merged or queued request. Call with lh_lock
+ * held.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct lhd_request *req = lh->lh_active;
+	struct lhd_request *next;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (req == NULL) {
+		/* spurious */
+		return;
+	}
+
+	if (err == 0) {
+		if (!req->lr_iswrite) {
+			membar_load_load();
+			memcpy(req->lr_buf + req->lr_done*LHD_SECTSIZE,
+			       lh->lh_buf, LHD_SECTSIZE);
+		}
+		req->lr_done++;
+		if (req->lr_done < req->lr_nsect) {
+			lhd_start(lh);
+			return;
+		}
+	}
+
+	/* The rest of the merged chain, if any, runs next. */
+	next = req->lr_mergenext;
+	if (next != NULL) {
+		next->lr_mergetail = req->lr_mergetail;
+		next->lr_endsector = req->lr_endsector;
+	}
+
+	req->lr_result = err;
+	req->lr_callback(req, req->lr_cbdata);
+
+	lh->lh_active = next;
+	if (next != NULL) {
+		lhd_start(lh);
+	}
+	else {
+		lhd_dispatch(lh);
+	}
+}
+
+/*
+ * Try to merge REQ behind a queued request whose chain ends where REQ
+ * starts. The active request's chain is left alone; chained requests
+ * bypass lhd_pick, so growing it could starve the queue. Call with
+ * lh_lock held.
+ */
+static
+bool
+lhd_merge(struct lhd_softc *lh, struct lhd_request *req)
+{
+	struct lhd_request *head;
+
+	for (head = lh->lh_queue; head != NULL; head = head->lr_next) {
+		if (head->lr_iswrite == req->lr_iswrite &&
+		    head->lr_endsector == req->lr_sector) {
+			break;
+		}
+	}
+	if (head == NULL) {
+		return false;
+	}
+
+	head->lr_mergetail->lr_mergenext = req;
+	head->lr_mergetail = req;
+	head->lr_endsector = req->lr_endsector;
+	return true;
+}
+
+/*
+ * Queue a request. The device is started if it is idle; the request's
+ * callback is called from the interrupt handler once it is done.
+ */
+void
+lhd_strategy(struct lhd_softc *lh, struct lhd_request *req)
+{
+	struct lhd_request **pp;
+
+	KASSERT(req->lr_callback != NULL);
+	KASSERT(req->lr_nsect > 0);
+
+	req->lr_done = 0;
+	req->lr_result = 0;
+	req->lr_endsector = req->lr_sector + req->lr_nsect;
+	req->lr_mergenext = NULL;
+	req->lr_mergetail = req;
+	req->lr_next = NULL;
+
+	spinlock_acquire(&lh->lh_lock);
+	if (!lhd_merge(lh, req)) {
+		req->lr_deadline = lh->lh_dispatches + LHD_DEADLINE;
+		for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next) {
+			/* nothing */
+		}
+		*pp = req;
+		lhd_dispatch(lh);
+	}
+	spinlock_release(&lh->lh_lock);
 }
 
 /*
@@ -118,6 +312,8 @@ lhd_irq(void *vlh)
 	struct lhd_softc *lh = vlh;
 	uint32_t val;
 
+	spinlock_acquire(&lh->lh_lock);
+
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
@@ -131,6 +327,8 @@ lhd_irq(void *vlh)
 		lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
 	}
+
+	spinlock_release(&lh->lh_lock);
 }
 
 /*
@@ -179,8 +377,62 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Completion callback for synchronous requests: clear lr_cbdata to
+ * mark the request done, and wake the submitter.
+ */
+static
+void
+lhd_syncdone(struct lhd_request *req, void *vlh)
+{
+	struct lhd_softc *lh = vlh;
+
+	req->lr_cbdata = NULL;
+	wchan_wakeall(lh->lh_wchan, &lh->lh_lock);
+}
+
+/*
+ * Queue a request and wait for the whole of it to finish.
+ */
+static
+int
+lhd_submit(struct lhd_softc *lh, struct lhd_request *req)
+{
+	req->lr_callback = lhd_syncdone;
+	req->lr_cbdata = lh;
+	lhd_strategy(lh, req);
+
+	spinlock_acquire(&lh->lh_lock);
+	while (req->lr_cbdata != NULL) {
+		wchan_sleep(lh->lh_wchan, &lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	return req->lr_result;
+}
+
+/*
+ * Advance a kernel uio whose data we transferred directly.
+ */
+static
+void
+lhd_uioskip(struct uio *uio, size_t len)
+{
+	KASSERT(uio->uio_iov->iov_len >= len);
+	uio->uio_iov->iov_kbase = (char *)uio->uio_iov->iov_kbase + len;
+	uio->uio_iov->iov_len -= len;
+	uio->uio_offset += len;
+	uio->uio_resid -= len;
+}
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * The common case (a buffer cache or swap page in kernel memory) is
+ * transferred straight into/out of the caller's buffer as a single
+ * request. Anything else goes through a bounce buffer, LHD_MAXBOUNCE
+ * sectors at a time, because the interrupt handler can't touch user
+ * memory.
  */
 static
 int
@@ -192,8 +444,9 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	struct lhd_request req;
+	char *bounce;
+	uint32_t n;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -207,61 +460,68 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
+	}
+
+	req.lr_iswrite = (uio->uio_rw == UIO_WRITE);
+
+	if (uio->uio_segflg == UIO_SYSSPACE &&
+	    uio->uio_iov->iov_len >= uio->uio_resid) {
+		req.lr_buf = uio->uio_iov->iov_kbase;
+		req.lr_sector = sector;
+		req.lr_nsect = len;
+		result = lhd_submit(lh, &req);
+		if (result) {
+			return result;
+		}
+		lhd_uioskip(uio, len * LHD_SECTSIZE);
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
+	bounce = kmalloc(LHD_MAXBOUNCE * LHD_SECTSIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
+	req.lr_buf = bounce;
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	result = 0;
+	while (len > 0) {
+		n = len < LHD_MAXBOUNCE ? len : LHD_MAXBOUNCE;
 
 		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
+		 * Are we writing? If so, fetch the data first.
 		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
+		if (req.lr_iswrite) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
+		req.lr_sector = sector;
+		req.lr_nsect = n;
+		result = lhd_submit(lh, &req);
+		if (result) {
+			break;
+		}
 
 		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
+		 * Are we reading? If so, hand the data over.
 		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		if (!req.lr_iswrite) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
 		}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
-		}
+		sector += n;
+		len -= n;
 	}
 
-	return 0;
+	kfree(bounce);
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
@@ -284,17 +544,16 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
 		return ENOMEM;
 	}
+	lh->lh_active = NULL;
+	lh->lh_queue = NULL;
+	lh->lh_headpos = 0;
+	lh->lh_dispatches = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
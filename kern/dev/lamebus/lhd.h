@@ -31,12 +31,62 @@
 #define _LAMEBUS_LHD_H_
 
 #include <device.h>
+#include <spinlock.h>
 
 /*
  * Our sector size
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * Largest transfer we bounce through a kernel buffer in one request
+ * (I/O on user memory, or on scattered kernel iovecs).
+ */
+#define LHD_MAXBOUNCE  16
+
+/*
+ * Scheduling: the queue is served in C-SCAN order (ascending sectors
+ * from the current head position, then wrap to the lowest), except
+ * that a request passed over by LHD_DEADLINE dispatches is served
+ * next regardless, so nothing starves behind a busy region.
+ */
+#define LHD_DEADLINE   32
+
+struct lhd_request;
+typedef void (*lhd_callback_t)(struct lhd_request *, void *cbdata);
+
+/*
+ * A queued transfer of one or more consecutive sectors to or from a
+ * kernel buffer. The interrupt handler moves each sector between the
+ * buffer and the on-card buffer and starts the next one itself, so
+ * the caller is notified once, when the whole request is done.
+ *
+ * A request that starts where a queued one in the same direction
+ * ends is merged behind it (lr_mergenext) and runs back-to-back with
+ * it without going through the scheduler again. Nothing is merged
+ * behind the active request: a chain only grows while it waits its
+ * turn, so a long sequential stream can't hold the disk past the
+ * deadlines of the requests queued behind it.
+ */
+struct lhd_request {
+	/* Set by the submitter */
+	char *lr_buf;			/* Kernel data buffer */
+	uint32_t lr_sector;		/* First sector */
+	uint32_t lr_nsect;		/* Number of sectors */
+	bool lr_iswrite;
+	lhd_callback_t lr_callback;	/* Completion, called with lh_lock */
+	void *lr_cbdata;		/*   held: must not sleep */
+
+	/* Driver state */
+	uint32_t lr_done;		/* Sectors transferred so far */
+	int lr_result;
+	unsigned lr_deadline;		/* Dispatch count to serve it by */
+	uint32_t lr_endsector;		/* End of the merged chain */
+	struct lhd_request *lr_mergenext; /* Merged chain */
+	struct lhd_request *lr_mergetail;
+	struct lhd_request *lr_next;	/* Queue link */
+};
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +101,12 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the queue and device regs */
+	struct wchan *lh_wchan;		/* Callers waiting for completion */
+	struct lhd_request *lh_active;	/* Request the device is working on */
+	struct lhd_request *lh_queue;	/* Requests waiting, arrival order */
+	uint32_t lh_headpos;		/* Sector after the last one started */
+	unsigned lh_dispatches;		/* Requests dispatched so far */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -61,4 +114,7 @@ struct lhd_softc {
 /* Functions called by lower-level drivers */
 void lhd_irq(/*struct lhd_softc*/ void *);	/* Interrupt handler */
 
+/* Queue a request without waiting; its callback reports completion. */
+void lhd_strategy(struct lhd_softc *lh, struct lhd_request *req);
+
 #endif /* _LAMEBUS_LHD_H_ */
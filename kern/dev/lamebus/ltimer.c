@@ -46,11 +46,26 @@
 #define LT_REG_COUNT  16    /* Time for countdown timer (usec) */
 #define LT_REG_SPKR   20    /* Beep control */
 
-/* Granularity of countdown timer (usec) */
-#define LT_GRANULARITY   1000000
-
 static bool havetimerclock;
 
+/*
+ * Start a one-shot countdown of USECS microseconds; the interrupt at
+ * the end of it calls timerclock(). Writing the count register
+ * restarts the countdown, cancelling any previous one.
+ */
+static
+void
+ltimer_oneshot(void *vlt, uint32_t usecs)
+{
+	struct ltimer_softc *lt = vlt;
+
+	if (usecs == 0) {
+		/* zero would mean "stop" */
+		usecs = 1;
+	}
+	bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_COUNT, usecs);
+}
+
 /*
  * Setup routine called by autoconf stuff when an ltimer is found.
  */
@@ -85,16 +100,15 @@ config_ltimer(struct ltimer_softc *lt, int ltimerno)
 
 	/*
 	 * We do, however, use ltimer for the timer clock, since the
-	 * on-chip timer can't do that.
+	 * on-chip timer can't do that. It runs in one-shot mode and
+	 * clock.c programs it for whenever the next timer expires.
 	 */
 	if (!havetimerclock) {
 		havetimerclock = true;
 		lt->lt_timerclock = 1;
 
-		/* Wire it to go off once every second. */
-		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_ROE, 1);
-		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_COUNT,
-				   LT_GRANULARITY);
+		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_ROE, 0);
+		clock_register_oneshot(lt, ltimer_oneshot);
 	}
 
 	return 0;
@@ -33,8 +33,10 @@
  * Block allocation.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
+#include <synch.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -52,18 +54,308 @@ sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 }
 
 /*
- * Allocate a block.
+ * Number of blocks reserved past each block handed to a file, so
+ * that a file written a block at a time still ends up contiguous
+ * when other files are being written at the same time.
  */
+#define SFS_PREALLOC	8
+
+/*
+ * Note that the freemap block holding BLOCK's bit has changed and
+ * needs to go to disk at the next sync. Call with sfs_freemaplock
+ * held.
+ */
+static
+void
+sfs_fmtouch(struct sfs_fs *sfs, daddr_t block)
+{
+	unsigned fmblock;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	fmblock = block / SFS_BITSPERBLOCK;
+	if (!bitmap_isset(sfs->sfs_fmdirty, fmblock)) {
+		bitmap_mark(sfs->sfs_fmdirty, fmblock);
+		sfs->sfs_nfmdirty++;
+	}
+}
+
+/*
+ * Check if BLOCK is free and can be handed out. A block that has
+ * been freed but whose release isn't on disk yet (see sfs_sync) is
+ * not: until then the old owner's inode may still point at it on
+ * disk. Call with sfs_freemaplock held.
+ */
+static
+bool
+sfs_bavail(struct sfs_fs *sfs, daddr_t block)
+{
+	return !bitmap_isset(sfs->sfs_freemap, block) &&
+		!bitmap_isset(sfs->sfs_freed, block) &&
+		!bitmap_isset(sfs->sfs_freeing, block);
+}
+
+/*
+ * Mark BLOCK allocated. Call with sfs_freemaplock held.
+ */
+static
+void
+sfs_bmark(struct sfs_fs *sfs, daddr_t block)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	bitmap_mark(sfs->sfs_freemap, block);
+	sfs_fmtouch(sfs, block);
+}
+
+/*
+ * Mark BLOCK free. It goes on the list of pending frees, which sync
+ * writes to disk only once whatever pointed at the block has been
+ * written. Call with sfs_freemaplock held.
+ */
+static
+void
+sfs_bunmark(struct sfs_fs *sfs, daddr_t block)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	bitmap_unmark(sfs->sfs_freemap, block);
+	bitmap_mark(sfs->sfs_freed, block);
+	sfs_fmtouch(sfs, block);
+}
+
+/*
+ * Take SV off the list of files with preallocated blocks, now that
+ * its window is empty. Call with sfs_freemaplock held.
+ */
+static
+void
+sfs_prealloc_unlink(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **pp;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	KASSERT(sv->sv_palen == 0);
+
+	for (pp = &sfs->sfs_palist; *pp != NULL; pp = &(*pp)->sv_panext) {
+		if (*pp == sv) {
+			*pp = sv->sv_panext;
+			sv->sv_panext = NULL;
+			return;
+		}
+	}
+	panic("sfs: %s: vnode %u not on preallocation list\n",
+	      sfs->sfs_sb.sb_volname, sv->sv_ino);
+}
+
+/*
+ * The volume is full: take back the last unused block of some
+ * file's preallocation window. It is returned free in the freemap,
+ * as if sfs_bfindfree had found it. Call with sfs_freemaplock held.
+ */
+static
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
+sfs_prealloc_steal(struct sfs_fs *sfs, daddr_t *ret)
 {
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	sv = sfs->sfs_palist;
+	if (sv == NULL) {
+		return ENOSPC;
+	}
+	KASSERT(sv->sv_palen > 0);
+	sv->sv_palen--;
+	*ret = sv->sv_pastart + sv->sv_palen;
+	if (sv->sv_palen == 0) {
+		sfs_prealloc_unlink(sfs, sv);
+	}
+	bitmap_unmark(sfs->sfs_freemap, *ret);
+	return 0;
+}
+
+/*
+ * Find a free block, looking first at GOAL and then forward from it
+ * (wrapping around at the end of the volume). The freemap is an
+ * array of bytes, so skip over full bytes eight blocks at a time.
+ * If there is none, fall back on other files' preallocation
+ * windows. Call with sfs_freemaplock held.
+ */
+static
+int
+sfs_bfindfree(struct sfs_fs *sfs, daddr_t goal, daddr_t *ret)
+{
+	const uint8_t *map, *freed, *freeing;
+	uint32_t nblocks, nbytes, n, ix, bit;
+	daddr_t block;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	nblocks = sfs->sfs_sb.sb_nblocks;
+	if (goal >= nblocks) {
+		goal = 0;
+	}
+	if (sfs_bavail(sfs, goal)) {
+		*ret = goal;
+		return 0;
+	}
+
+	map = bitmap_getdata(sfs->sfs_freemap);
+	freed = bitmap_getdata(sfs->sfs_freed);
+	freeing = bitmap_getdata(sfs->sfs_freeing);
+	nbytes = DIVROUNDUP(nblocks, CHAR_BIT);
+
+	/*
+	 * Go one byte past a full lap so the bits before GOAL in its
+	 * own byte get looked at on the way back around.
+	 */
+	for (n=0; n<=nbytes; n++) {
+		ix = (goal / CHAR_BIT + n) % nbytes;
+		if ((map[ix] | freed[ix] | freeing[ix]) == 0xff) {
+			continue;
+		}
+		for (bit=0; bit<CHAR_BIT; bit++) {
+			block = ix * CHAR_BIT + bit;
+			if (block >= nblocks) {
+				break;
+			}
+			if (n == 0 && block < goal) {
+				continue;
+			}
+			if (sfs_bavail(sfs, block)) {
+				*ret = block;
+				return 0;
+			}
+		}
+	}
+	return sfs_prealloc_steal(sfs, ret);
+}
+
+/*
+ * Record that BLOCK has been allocated but nothing has been written
+ * to it yet, so its on-disk contents are stale. Call with
+ * sfs_freemaplock held.
+ */
+static
+void
+sfs_buninit_mark(struct sfs_fs *sfs, daddr_t block)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	KASSERT(!bitmap_isset(sfs->sfs_uninitmap, block));
+	bitmap_mark(sfs->sfs_uninitmap, block);
+	sfs->sfs_nuninit++;
+}
+
+/*
+ * Clear BLOCK's uninitialized mark, if it has one; return whether it
+ * did. Call with sfs_freemaplock held.
+ */
+static
+bool
+sfs_buninit_clear(struct sfs_fs *sfs, daddr_t block)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	if (sfs->sfs_nuninit == 0 ||
+	    !bitmap_isset(sfs->sfs_uninitmap, block)) {
+		return false;
+	}
+	bitmap_unmark(sfs->sfs_uninitmap, block);
+	sfs->sfs_nuninit--;
+	return true;
+}
+
+/*
+ * Check if BLOCK is allocated but uninitialized. Readers treat such
+ * a block as all zeros without going to disk.
+ *
+ * A block only becomes uninitialized, or stops being so, under the
+ * vnode lock of the file it belongs to (or with its buffer busy), so
+ * when the count is zero there is nothing of the caller's to find
+ * and we can skip the lock.
+ */
+bool
+sfs_buninit(struct sfs_fs *sfs, daddr_t block)
+{
+	bool ret;
+
+	if (sfs->sfs_nuninit == 0) {
+		return false;
+	}
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_uninitmap, block);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
+}
+
+/*
+ * BLOCK's buffer now holds its real contents (the caller has filled
+ * it in and marked it dirty), so it no longer reads as zeros.
+ */
+void
+sfs_binit(struct sfs_fs *sfs, daddr_t block)
+{
+	if (sfs->sfs_nuninit == 0) {
+		return;
+	}
+	lock_acquire(sfs->sfs_freemaplock);
+	(void)sfs_buninit_clear(sfs, block);
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Write zeros to every block still uninitialized. This happens only
+ * when a write failed after its block was allocated; we do it before
+ * the inodes pointing at such blocks can reach disk, so stale data
+ * never becomes visible after a remount.
+ *
+ * The owning file may be writing the block at the same time, so
+ * check again with its buffer busy and only zero it if it is still
+ * uninitialized then.
+ */
+int
+sfs_binit_all(struct sfs_fs *sfs)
+{
+	struct sfs_buf *buf;
+	daddr_t block;
+	bool uninit;
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	for (block = 0; sfs->sfs_nuninit > 0 &&
+		     block < sfs->sfs_sb.sb_nblocks; block++) {
+		if (!sfs_buninit(sfs, block)) {
+			continue;
+		}
+		result = sfs_bget(sfs, block, &buf);
+		if (result) {
+			return result;
+		}
+		lock_acquire(sfs->sfs_freemaplock);
+		uninit = sfs_buninit_clear(sfs, block);
+		lock_release(sfs->sfs_freemaplock);
+		if (uninit) {
+			bzero(sfs_bdata(buf), SFS_BLOCKSIZE);
+			sfs_bdirty(buf);
+		}
+		sfs_brelse(buf);
+	}
+	return 0;
+}
+
+/*
+ * Allocate a block, preferably GOAL or the first free block after
+ * it. Pass 0 if there's no preference.
+ */
+int
+sfs_balloc(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock)
+{
+	int result;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	result = sfs_bfindfree(sfs, goal, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	sfs_bmark(sfs, *diskblock);
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: balloc: invalid block %u\n",
@@ -73,19 +365,230 @@ sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
 	/* Clear block before returning it */
 	result = sfs_clearblock(sfs, *diskblock);
 	if (result) {
-		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		lock_acquire(sfs->sfs_freemaplock);
+		sfs_bunmark(sfs, *diskblock);
+		lock_release(sfs->sfs_freemaplock);
 	}
 	return result;
 }
 
+/*
+ * Allocate a block for file SV. Blocks are taken from the file's
+ * preallocation window if it has one; otherwise we allocate right
+ * after the last block the file got (or after its inode, for the
+ * first one) and reserve the next few free blocks as a new window.
+ *
+ * If ZERO is set the block is cleared, as sfs_balloc does. Otherwise
+ * it is only marked uninitialized: data blocks are usually about to
+ * be overwritten, so writing zeros first would be wasted I/O.
+ *
+ * The window is marked in the freemap like any other allocated
+ * block, and handed back by sfs_prealloc_release when the file is
+ * truncated or reclaimed. A crash in between leaves the blocks
+ * marked but unreferenced, which sfsck repairs. Files with a window
+ * are kept on sfs_palist, so that once the volume is full other
+ * files can take the blocks back (sfs_prealloc_steal); that is why
+ * the window is looked at only under sfs_freemaplock.
+ */
+int
+sfs_balloc_file(struct sfs_vnode *sv, bool zero, daddr_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t block, goal;
+	unsigned i;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sv->sv_palen > 0) {
+		block = sv->sv_pastart;
+		KASSERT(bitmap_isset(sfs->sfs_freemap, block));
+		sv->sv_pastart++;
+		sv->sv_palen--;
+		if (sv->sv_palen == 0) {
+			sfs_prealloc_unlink(sfs, sv);
+		}
+		if (!zero) {
+			sfs_buninit_mark(sfs, block);
+		}
+		lock_release(sfs->sfs_freemaplock);
+
+		if (zero) {
+			result = sfs_clearblock(sfs, block);
+			if (result) {
+				/* It's still ours; give it back */
+				lock_acquire(sfs->sfs_freemaplock);
+				bitmap_unmark(sfs->sfs_freemap, block);
+				sfs_fmtouch(sfs, block);
+				lock_release(sfs->sfs_freemaplock);
+				return result;
+			}
+		}
+		sv->sv_goal = block + 1;
+		*diskblock = block;
+		return 0;
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	goal = sv->sv_goal != 0 ? sv->sv_goal : sv->sv_ino + 1;
+	if (zero) {
+		result = sfs_balloc(sfs, goal, &block);
+		if (result) {
+			return result;
+		}
+		lock_acquire(sfs->sfs_freemaplock);
+	}
+	else {
+		lock_acquire(sfs->sfs_freemaplock);
+		result = sfs_bfindfree(sfs, goal, &block);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+		sfs_bmark(sfs, block);
+		sfs_buninit_mark(sfs, block);
+	}
+	sv->sv_goal = block + 1;
+
+	/* Reserve whatever free run follows, up to SFS_PREALLOC blocks */
+	for (i=1; i<SFS_PREALLOC; i++) {
+		if (block + i >= sfs->sfs_sb.sb_nblocks ||
+		    !sfs_bavail(sfs, block + i)) {
+			break;
+		}
+		sfs_bmark(sfs, block + i);
+	}
+	sv->sv_pastart = block + 1;
+	sv->sv_palen = i - 1;
+	if (sv->sv_palen > 0) {
+		KASSERT(sv->sv_panext == NULL);
+		sv->sv_panext = sfs->sfs_palist;
+		sfs->sfs_palist = sv;
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * Give back the unused part of a file's preallocation window.
+ * Nothing on disk has ever pointed at these blocks, so unlike ones
+ * passed to sfs_bfree they can be handed out again at once.
+ */
+void
+sfs_prealloc_release(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t block;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sv->sv_palen > 0) {
+		for (i=0; i<sv->sv_palen; i++) {
+			block = sv->sv_pastart + i;
+			bitmap_unmark(sfs->sfs_freemap, block);
+			sfs_fmtouch(sfs, block);
+		}
+		sv->sv_palen = 0;
+		sfs_prealloc_unlink(sfs, sv);
+	}
+	lock_release(sfs->sfs_freemaplock);
+}
+
 /*
  * Free a block.
+ *
+ * If the block was referenced from disk, the caller must hold
+ * sfs_freelock for reading until the metadata that dropped the
+ * reference has been copied into the buffer cache; see sfs_sync.
  */
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	sfs_binval(sfs, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	(void)sfs_buninit_clear(sfs, diskblock);
+	sfs_bunmark(sfs, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Start a sync: the blocks freed so far become the ones this sync
+ * will release on disk. Anything freed from here on waits for the
+ * next one. The caller holds sfs_freelock for writing, so every free
+ * counted here has its metadata in the buffer cache already.
+ */
+void
+sfs_bfree_collect(struct sfs_fs *sfs)
+{
+	uint8_t *freed, *freeing;
+	uint32_t i, nbytes;
+
+	KASSERT(rwlock_do_i_hold_write(sfs->sfs_freelock));
+
+	lock_acquire(sfs->sfs_freemaplock);
+	freed = bitmap_getdata(sfs->sfs_freed);
+	freeing = bitmap_getdata(sfs->sfs_freeing);
+	nbytes = DIVROUNDUP(sfs->sfs_sb.sb_nblocks, CHAR_BIT);
+	for (i=0; i<nbytes; i++) {
+		/* a failed sync may have left some behind; keep them */
+		freeing[i] |= freed[i];
+		freed[i] = 0;
+	}
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Finish a sync: the metadata that pointed at the blocks collected
+ * by sfs_bfree_collect is on disk, so they can be shown free there
+ * too, and handed out again.
+ */
+void
+sfs_bfree_commit(struct sfs_fs *sfs)
+{
+	uint8_t *freeing;
+	uint32_t i, nbytes;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	freeing = bitmap_getdata(sfs->sfs_freeing);
+	nbytes = DIVROUNDUP(sfs->sfs_sb.sb_nblocks, CHAR_BIT);
+	for (i=0; i<nbytes; i++) {
+		if (freeing[i] != 0) {
+			freeing[i] = 0;
+			sfs_fmtouch(sfs, i * CHAR_BIT);
+		}
+	}
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Check if any blocks are free but held back until a sync releases
+ * them, so that a failed allocation might succeed after one.
+ */
+bool
+sfs_bpending(struct sfs_fs *sfs)
+{
+	const uint8_t *freed, *freeing;
+	uint32_t i, nbytes;
+	bool ret = false;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	freed = bitmap_getdata(sfs->sfs_freed);
+	freeing = bitmap_getdata(sfs->sfs_freeing);
+	nbytes = DIVROUNDUP(sfs->sfs_sb.sb_nblocks, CHAR_BIT);
+	for (i=0; i<nbytes; i++) {
+		if ((freed[i] | freeing[i]) != 0) {
+			ret = true;
+			break;
+		}
+	}
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
 /*
@@ -94,10 +597,14 @@ sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 int
 sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: sfs_bused called on out of range block %u\n",
 		      sfs->sfs_sb.sb_volname, diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
-
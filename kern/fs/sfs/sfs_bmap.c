@@ -35,39 +35,179 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Number of file blocks reachable through one indirect block at
+ * level LEVEL (1 = single indirect, 2 = double, 3 = triple).
+ */
+static
+uint32_t
+sfs_ibspan(int level)
+{
+	uint32_t span = 1;
+
+	while (level-- > 0) {
+		span *= SFS_DBPERIDB;
+	}
+	return span;
+}
+
+/*
+ * Look up entry OFFSET in the tree hanging off the indirect block at
+ * level LEVEL whose number is stored in *IBLOCKP. If DOALLOC is set,
+ * allocate the indirect block and any missing blocks below it,
+ * storing the new numbers and setting *CHANGED when *IBLOCKP itself
+ * is updated. The caller holds the buffer *IBLOCKP lives in (or the
+ * inode), so at most one buffer per level is busy at a time.
+ */
+static
+int
+sfs_bmap_indirect(struct sfs_vnode *sv, uint32_t *iblockp, bool *changed,
+		  int level, uint32_t offset, bool doalloc,
+		  daddr_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *iddata;
+	daddr_t idblock, block;
+	uint32_t span, idoff;
+	bool childchanged;
+	int result;
+
+	idblock = *iblockp;
+	if (idblock == 0 && !doalloc) {
+		/*
+		 * There's no indirect block allocated. We weren't
+		 * asked to allocate anything, so pretend the indirect
+		 * block was filled with all zeros.
+		 */
+		*diskblock = 0;
+		return 0;
+	}
+	else if (idblock == 0) {
+		/*
+		 * We need to store a block number in an indirect
+		 * block that doesn't exist yet, so allocate it.
+		 */
+		result = sfs_balloc_file(sv, true, &idblock);
+		if (result) {
+			return result;
+		}
+		*iblockp = idblock;
+		*changed = true;
+	}
+
+	/*
+	 * Load the indirect block. (If we just allocated it,
+	 * sfs_balloc_file left it zeroed in the buffer cache.)
+	 */
+	result = sfs_bread(sfs, idblock, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = sfs_bdata(idbuf);
+
+	span = sfs_ibspan(level - 1);
+	idoff = offset / span;
+	KASSERT(idoff < SFS_DBPERIDB);
+
+	if (level > 1) {
+		/* Descend into the next level down */
+		childchanged = false;
+		result = sfs_bmap_indirect(sv, &iddata[idoff], &childchanged,
+					   level - 1, offset % span, doalloc,
+					   diskblock);
+		if (childchanged) {
+			sfs_bdirty(idbuf);
+		}
+		sfs_brelse(idbuf);
+		return result;
+	}
+
+	/* Get the block out of the indirect block buffer */
+	block = iddata[idoff];
+
+	/* If there's no block there, allocate one */
+	if (block==0 && doalloc) {
+		result = sfs_balloc_file(sv, false, &block);
+		if (result) {
+			sfs_brelse(idbuf);
+			return result;
+		}
+
+		/* Remember the block we allocated; the indirect block is dirty */
+		iddata[idoff] = block;
+		sfs_bdirty(idbuf);
+	}
+	sfs_brelse(idbuf);
+
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * Remember that FILEBLOCK lives at disk block BLOCK. Each vnode keeps
+ * one run of file blocks known to be contiguous on disk; a lookup
+ * that extends the run grows it, and anything else starts a new one.
+ * Since sfs_balloc_file lays sequentially written files out in
+ * order, this usually lets a whole file be mapped without touching
+ * its indirect blocks.
+ */
+static
+void
+sfs_bmap_remember(struct sfs_vnode *sv, uint32_t fileblock, daddr_t block)
+{
+	if (sv->sv_extlen > 0 &&
+	    fileblock == sv->sv_extfile + sv->sv_extlen &&
+	    block == sv->sv_extdisk + sv->sv_extlen) {
+		sv->sv_extlen++;
+		return;
+	}
+	sv->sv_extfile = fileblock;
+	sv->sv_extdisk = block;
+	sv->sv_extlen = 1;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
  * allocated.
+ *
+ * Blocks past the direct blocks are found through the single, double,
+ * and triple indirect blocks, in that order.
  */
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	 daddr_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	daddr_t block;
-	daddr_t idblock;
-	uint32_t idnum, idoff;
+	uint32_t *iblockp;
+	uint32_t offset, span;
+	bool changed;
+	int level;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	COMPILE_ASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	/* The inode has exactly one indirect pointer of each depth */
+	COMPILE_ASSERT(SFS_NINDIRECT == 1);
+	COMPILE_ASSERT(SFS_NDINDIRECT == 1);
+	COMPILE_ASSERT(SFS_NTINDIRECT == 1);
+
+	/* Try the cached run first */
+	if (sv->sv_extlen > 0 && fileblock >= sv->sv_extfile &&
+	    fileblock - sv->sv_extfile < sv->sv_extlen) {
+		*diskblock = sv->sv_extdisk + (fileblock - sv->sv_extfile);
+		return 0;
+	}
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -82,7 +222,7 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			result = sfs_balloc_file(sv, false, &block);
 			if (result) {
 				return result;
 			}
@@ -100,132 +240,177 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 			      "marked free\n", sfs->sfs_sb.sb_volname,
 			      block, fileblock, sv->sv_ino);
 		}
+		if (block != 0) {
+			sfs_bmap_remember(sv, fileblock, block);
+		}
 		*diskblock = block;
 		return 0;
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
+	 * It's not a direct block. Subtract off the range covered by
+	 * each level in turn until we find the indirect block whose
+	 * tree holds it; OFFSET is then the index within that tree.
 	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
+	offset = fileblock - SFS_NDIRECT;
+	iblockp = NULL;
+	for (level = 1; level <= 3; level++) {
+		span = sfs_ibspan(level);
+		if (offset < span) {
+			switch (level) {
+			    case 1: iblockp = &sv->sv_i.sfi_indirect; break;
+			    case 2: iblockp = &sv->sv_i.sfi_dindirect; break;
+			    case 3: iblockp = &sv->sv_i.sfi_tindirect; break;
+			}
+			break;
+		}
+		offset -= span;
+	}
 
 	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
+	 * Past the end of the triple indirect block; we can't handle
+	 * it, so fail.
 	 */
-	if (idnum >= SFS_NINDIRECT) {
+	if (iblockp == NULL) {
 		return EFBIG;
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
-
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
-		return 0;
+	changed = false;
+	result = sfs_bmap_indirect(sv, iblockp, &changed, level, offset,
+				   doalloc, &block);
+	if (changed) {
+		/* We allocated the top-level indirect block */
+		sv->sv_dirty = true;
+	}
+	if (result) {
+		return result;
 	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
-		if (result) {
-			return result;
-		}
 
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+	/* Hand back the result and return. */
+	if (block != 0 && !sfs_bused(sfs, block)) {
+		panic("sfs: %s: Data block %u (block %u of file %u) "
+		      "marked free\n", sfs->sfs_sb.sb_volname,
+		      block, fileblock, sv->sv_ino);
+	}
+	if (block != 0) {
+		sfs_bmap_remember(sv, fileblock, block);
+	}
+	*diskblock = block;
+	return 0;
+}
 
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
+/*
+ * Free every block past BLOCKLEN in the tree hanging off the indirect
+ * block at level LEVEL whose number is in *IBLOCKP. BASEBLOCK is the
+ * file block number of the first block that tree maps. If the
+ * indirect block ends up empty it is freed too, and *IBLOCKP is
+ * cleared and *CHANGED set.
+ */
+static
+int
+sfs_itrunc_indirect(struct sfs_fs *sfs, uint32_t *iblockp, bool *changed,
+		    int level, uint32_t baseblock, uint32_t blocklen)
+{
+	struct sfs_buf *idbuf;
+	uint32_t *iddata;
+	daddr_t idblock;
+	uint32_t span, j;
+	bool childchanged;
+	bool hasnonzero;
+	int result;
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+	idblock = *iblockp;
+	if (idblock == 0) {
+		return 0;
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
+
+	/* If the whole tree is below the new EOF there's nothing to do */
+	if (baseblock + sfs_ibspan(level) <= blocklen) {
+		return 0;
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	/* Read the indirect block */
+	result = sfs_bread(sfs, idblock, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = sfs_bdata(idbuf);
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
-		if (result) {
-			return result;
+	span = sfs_ibspan(level - 1);
+	hasnonzero = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		if (iddata[j] == 0) {
+			continue;
 		}
-
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
+		if (level > 1) {
+			childchanged = false;
+			result = sfs_itrunc_indirect(sfs, &iddata[j],
+						     &childchanged, level - 1,
+						     baseblock + j*span,
+						     blocklen);
+			if (childchanged) {
+				sfs_bdirty(idbuf);
+			}
+			if (result) {
+				sfs_brelse(idbuf);
+				return result;
+			}
+		}
+		else if (baseblock + j >= blocklen) {
+			/* Discard any blocks that are past the new EOF */
+			sfs_bfree(sfs, iddata[j]);
+			iddata[j] = 0;
+			sfs_bdirty(idbuf);
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (iddata[j] != 0) {
+			hasnonzero = true;
 		}
 	}
+	sfs_brelse(idbuf);
 
-	/* Hand back the result and return. */
-	if (block != 0 && !sfs_bused(sfs, block)) {
-		panic("sfs: %s: Data block %u (block %u of file %u) "
-		      "marked free\n", sfs->sfs_sb.sb_volname,
-		      block, fileblock, sv->sv_ino);
+	if (!hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		sfs_bfree(sfs, idblock);
+		*iblockp = 0;
+		*changed = true;
 	}
-	*diskblock = block;
 	return 0;
 }
 
 /*
  * Called for ftruncate() and from sfs_reclaim.
+ *
+ * The blocks freed here may only be released on disk once the inode
+ * and indirect blocks that no longer point at them are written, so
+ * hold sfs_freelock for reading until all of that is in the buffer
+ * cache; see sfs_sync.
  */
 int
 sfs_itrunc(struct sfs_vnode *sv, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j;
-	daddr_t block, idblock;
-	uint32_t baseblock, highblock;
-	int result;
-	int hasnonzero, iddirty;
+	uint32_t i;
+	daddr_t block;
+	uint32_t baseblock;
+	bool changed;
+	int result, result2;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	rwlock_acquire_read(sfs->sfs_freelock);
 
-	vfs_biglock_acquire();
+	/*
+	 * Drop the cached run and hand back any preallocated blocks;
+	 * the blocks they describe may be about to go away.
+	 */
+	sv->sv_extlen = 0;
+	sv->sv_rablock = 0;
+	sfs_prealloc_release(sv);
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -240,64 +425,41 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
+	/*
+	 * Then the single, double, and triple indirect trees, each
+	 * of which starts where the previous one left off.
+	 */
+	changed = false;
 	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
+	result = sfs_itrunc_indirect(sfs, &sv->sv_i.sfi_indirect, &changed,
+				     1, baseblock, blocklen);
+	if (result == 0) {
+		baseblock += sfs_ibspan(1);
+		result = sfs_itrunc_indirect(sfs, &sv->sv_i.sfi_dindirect,
+					     &changed, 2, baseblock, blocklen);
+	}
+	if (result == 0) {
+		baseblock += sfs_ibspan(2);
+		result = sfs_itrunc_indirect(sfs, &sv->sv_i.sfi_tindirect,
+					     &changed, 3, baseblock, blocklen);
 	}
+	if (changed) {
+		sv->sv_dirty = true;
+	}
+	if (result == 0) {
+		/* Set the file size */
+		sv->sv_i.sfi_size = len;
 
-	/* Set the file size */
-	sv->sv_i.sfi_size = len;
+		/* Mark the inode dirty */
+		sv->sv_dirty = true;
+	}
 
-	/* Mark the inode dirty */
-	sv->sv_dirty = true;
+	/* Get the inode into the buffer cache along with the rest */
+	result2 = sfs_sync_inode(sv);
+	if (result == 0) {
+		result = result2;
+	}
 
-	vfs_biglock_release();
-	return 0;
+	rwlock_release_read(sfs->sfs_freelock);
+	return result;
 }
-
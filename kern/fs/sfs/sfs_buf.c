@@ -0,0 +1,750 @@
+/*
+ * SFS filesystem
+ *
+ * Buffer cache.
+ *
+ * Every block SFS reads or writes (superblock, freemap, inodes,
+ * indirect blocks, directory and file data) goes through one pool of
+ * block-sized buffers shared by all mounted SFS volumes, keyed by
+ * (volume, block number).
+ *
+ * A buffer is handed out "busy", i.e. for the caller's exclusive use,
+ * by sfs_bread (contents read from disk if needed) or sfs_bget
+ * (contents not read; the caller means to overwrite the whole
+ * block), and given back with sfs_brelse. Modified buffers are
+ * marked with sfs_bdirty and written back later: when the buffer is
+ * recycled for another block, or on sfs_bsync.
+ *
+ * The pool grows on demand up to a limit derived from the amount of
+ * physical memory, and stops growing early when free memory runs
+ * low; past that point the least recently used idle buffer is
+ * recycled.
+ *
+ * Locking: sfs_buflock protects the hash table, the LRU list, and
+ * the bookkeeping fields of every buffer. It is never held across
+ * I/O; a buffer being read or written is kept busy instead, and
+ * anyone who wants it waits on sfs_bufcv.
+ *
+ * A busy buffer works like a lock on its block. A thread may wait for
+ * one busy buffer while holding others only going down a file's
+ * block tree (an indirect block, then the block a new pointer in it
+ * refers to, which is free until then); clustering never waits for
+ * a neighbour, it just stops the run. See sfs.h for how buffers fit
+ * in with the other SFS locks.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <uio.h>
+#include <vfs.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+#include "opt-paging.h"
+#if OPT_PAGING
+#include <coremap.h>
+#endif
+
+/* Hash table size (buckets) */
+#define SFS_BUF_HASHSIZE   1024
+
+/* The pool may always grow to this many buffers */
+#define SFS_BUF_MIN        32
+
+#if OPT_PAGING
+/* At most 1/SFS_BUF_RAMFRAC of physical memory goes to buffers... */
+#define SFS_BUF_RAMFRAC    8
+/* ...and we stop growing when less than 1/SFS_BUF_LOWFRAC is free. */
+#define SFS_BUF_LOWFRAC    16
+#else
+/* Without the coremap we can't tell; use a fixed limit. */
+#define SFS_BUF_MAX        256
+#endif
+
+struct sfs_buf {
+	struct sfs_fs *b_fs;		/* Volume, or NULL if unused */
+	daddr_t b_block;		/* Block number on the volume */
+	char *b_data;			/* SFS_BLOCKSIZE bytes */
+	unsigned b_refcount;		/* Holder plus waiters */
+	bool b_busy;			/* Handed out, or under I/O */
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* b_data is newer than the disk */
+	struct sfs_buf *b_hashnext;	/* Hash chain */
+	struct sfs_buf *b_lruprev;	/* LRU list, most recent first */
+	struct sfs_buf *b_lrunext;
+};
+
+static struct lock *sfs_buflock;
+static struct cv *sfs_bufcv;
+static struct sfs_buf *sfs_bufhash[SFS_BUF_HASHSIZE];
+static struct sfs_buf *sfs_buflru_head, *sfs_buflru_tail;
+static unsigned sfs_nbufs;
+
+/* Statistics */
+static unsigned sfs_bufstat_hits;
+static unsigned sfs_bufstat_reads;
+static unsigned sfs_bufstat_writes;
+static unsigned sfs_bufstat_recycles;
+
+////////////////////////////////////////////////////////////
+// Setup
+
+/*
+ * Create the pool's lock and cv. Called from mount, which is
+ * serialized, before the first block is read.
+ */
+int
+sfs_buf_bootstrap(void)
+{
+	if (sfs_buflock != NULL) {
+		return 0;
+	}
+	sfs_bufcv = cv_create("sfs_buf");
+	if (sfs_bufcv == NULL) {
+		return ENOMEM;
+	}
+	sfs_buflock = lock_create("sfs_buf");
+	if (sfs_buflock == NULL) {
+		cv_destroy(sfs_bufcv);
+		sfs_bufcv = NULL;
+		return ENOMEM;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Hash table and LRU list (call with sfs_buflock held)
+
+static
+unsigned
+sfs_buf_hashfn(struct sfs_fs *sfs, daddr_t block)
+{
+	return (((uintptr_t)sfs >> 4) ^ block) % SFS_BUF_HASHSIZE;
+}
+
+static
+struct sfs_buf *
+sfs_buf_lookup(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *b;
+
+	b = sfs_bufhash[sfs_buf_hashfn(sfs, block)];
+	while (b != NULL) {
+		if (b->b_fs == sfs && b->b_block == block) {
+			return b;
+		}
+		b = b->b_hashnext;
+	}
+	return NULL;
+}
+
+static
+void
+sfs_buf_hashinsert(struct sfs_buf *b)
+{
+	unsigned h = sfs_buf_hashfn(b->b_fs, b->b_block);
+
+	b->b_hashnext = sfs_bufhash[h];
+	sfs_bufhash[h] = b;
+}
+
+static
+void
+sfs_buf_hashremove(struct sfs_buf *b)
+{
+	struct sfs_buf **pp;
+
+	pp = &sfs_bufhash[sfs_buf_hashfn(b->b_fs, b->b_block)];
+	while (*pp != b) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->b_hashnext;
+	}
+	*pp = b->b_hashnext;
+	b->b_hashnext = NULL;
+}
+
+static
+void
+sfs_buf_lruremove(struct sfs_buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		sfs_buflru_head = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		sfs_buflru_tail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+static
+void
+sfs_buf_lrufront(struct sfs_buf *b)
+{
+	b->b_lruprev = NULL;
+	b->b_lrunext = sfs_buflru_head;
+	if (sfs_buflru_head != NULL) {
+		sfs_buflru_head->b_lruprev = b;
+	}
+	else {
+		sfs_buflru_tail = b;
+	}
+	sfs_buflru_head = b;
+}
+
+////////////////////////////////////////////////////////////
+// Buffer allocation
+
+/*
+ * Decide whether the pool may grow by another buffer.
+ */
+static
+bool
+sfs_buf_cangrow(void)
+{
+#if OPT_PAGING
+	unsigned long nframes, nfree;
+
+	if (sfs_nbufs < SFS_BUF_MIN) {
+		return true;
+	}
+	if (!coremap_is_ready()) {
+		return false;
+	}
+	coremap_getstats(&nframes, &nfree);
+	if (sfs_nbufs >=
+	    nframes * (PAGE_SIZE / SFS_BLOCKSIZE) / SFS_BUF_RAMFRAC) {
+		return false;
+	}
+	return nfree > nframes / SFS_BUF_LOWFRAC;
+#else
+	return sfs_nbufs < SFS_BUF_MAX;
+#endif
+}
+
+/*
+ * Make a new, unused buffer and put it on the LRU list.
+ */
+static
+struct sfs_buf *
+sfs_buf_create(void)
+{
+	struct sfs_buf *b;
+
+	b = kmalloc(sizeof(*b));
+	if (b == NULL) {
+		return NULL;
+	}
+	b->b_data = kmalloc(SFS_BLOCKSIZE);
+	if (b->b_data == NULL) {
+		kfree(b);
+		return NULL;
+	}
+	b->b_fs = NULL;
+	b->b_block = 0;
+	b->b_refcount = 0;
+	b->b_busy = false;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_hashnext = NULL;
+	sfs_buf_lrufront(b);
+	sfs_nbufs++;
+	return b;
+}
+
+/*
+ * Transfer the contents of N busy buffers, which hold consecutive
+ * blocks, in one device request. Call without sfs_buflock held.
+ */
+static
+int
+sfs_buf_rwcluster(struct sfs_buf **bufs, unsigned n, enum uio_rw rw)
+{
+	struct iovec iov[SFS_BUF_CLUSTER];
+	struct uio ku;
+	unsigned i;
+
+	KASSERT(n > 0 && n <= SFS_BUF_CLUSTER);
+	for (i=0; i<n; i++) {
+		KASSERT(bufs[i]->b_busy);
+		KASSERT(bufs[i]->b_block == bufs[0]->b_block + i);
+		iov[i].iov_kbase = bufs[i]->b_data;
+		iov[i].iov_len = SFS_BLOCKSIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = (off_t)bufs[0]->b_block * SFS_BLOCKSIZE;
+	ku.uio_resid = n * SFS_BLOCKSIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+	return sfs_rwblock(bufs[0]->b_fs, &ku);
+}
+
+/*
+ * True if B is cached, dirty, and not wanted by anyone, so it can be
+ * written out along with a neighbour. Call with sfs_buflock held.
+ */
+static
+bool
+sfs_buf_idledirty(struct sfs_buf *b)
+{
+	return b != NULL && b->b_refcount == 0 && !b->b_busy &&
+		b->b_valid && b->b_dirty;
+}
+
+/*
+ * Write a busy buffer's contents to disk. Idle dirty buffers for the
+ * blocks on either side go in the same device request, up to
+ * SFS_BUF_CLUSTER blocks in all. Called with sfs_buflock held; drops
+ * it during the I/O.
+ *
+ * The volume's changed freemap blocks are written first. An inode or
+ * indirect block may point at blocks allocated since the last sync;
+ * if it reached the disk before the freemap did, the volume would be
+ * inconsistent until the next sync, and for good if we crashed.
+ */
+static
+int
+sfs_buf_writeout(struct sfs_buf *b)
+{
+	struct sfs_buf *bufs[SFS_BUF_CLUSTER];
+	struct sfs_buf *nb;
+	daddr_t first;
+	unsigned i, n;
+	int result;
+
+	KASSERT(b->b_busy);
+	KASSERT(b->b_valid && b->b_dirty);
+
+	/* Find how far back the run of dirty blocks goes */
+	first = b->b_block;
+	while (first > 0 && b->b_block - first < SFS_BUF_CLUSTER - 1 &&
+	       sfs_buf_idledirty(sfs_buf_lookup(b->b_fs, first - 1))) {
+		first--;
+	}
+
+	/* Collect the run, marking the neighbours busy */
+	n = 0;
+	while (n < SFS_BUF_CLUSTER) {
+		if (first + n == b->b_block) {
+			nb = b;
+		}
+		else {
+			nb = sfs_buf_lookup(b->b_fs, first + n);
+			if (!sfs_buf_idledirty(nb)) {
+				break;
+			}
+			nb->b_busy = true;
+		}
+		bufs[n++] = nb;
+	}
+	KASSERT(n > b->b_block - first);
+
+	lock_release(sfs_buflock);
+	result = sfs_sync_freemap(b->b_fs);
+	if (result == 0) {
+		result = sfs_buf_rwcluster(bufs, n, UIO_WRITE);
+	}
+	lock_acquire(sfs_buflock);
+
+	for (i=0; i<n; i++) {
+		if (result == 0) {
+			bufs[i]->b_dirty = false;
+			sfs_bufstat_writes++;
+		}
+		if (bufs[i] != b) {
+			bufs[i]->b_busy = false;
+		}
+	}
+	if (n > 1) {
+		cv_broadcast(sfs_bufcv, sfs_buflock);
+	}
+	return result;
+}
+
+/*
+ * Get a buffer not currently holding anything anyone wants, busy and
+ * unhashed: a new one if the pool may grow, otherwise the least
+ * recently used idle one (written back first if dirty). Call with
+ * sfs_buflock held.
+ */
+static
+int
+sfs_buf_getfree(struct sfs_buf **ret)
+{
+	struct sfs_buf *b;
+	int result;
+
+	if (sfs_buf_cangrow()) {
+		b = sfs_buf_create();
+		if (b != NULL) {
+			b->b_busy = true;
+			*ret = b;
+			return 0;
+		}
+	}
+
+ again:
+	for (b = sfs_buflru_tail; b != NULL; b = b->b_lruprev) {
+		if (b->b_refcount == 0 && !b->b_busy) {
+			break;
+		}
+	}
+	if (b == NULL) {
+		/* Everything is in use. Try to grow after all. */
+		b = sfs_buf_create();
+		if (b == NULL) {
+			return ENOMEM;
+		}
+		b->b_busy = true;
+		*ret = b;
+		return 0;
+	}
+
+	b->b_busy = true;
+	if (b->b_dirty) {
+		b->b_refcount++;
+		result = sfs_buf_writeout(b);
+		b->b_refcount--;
+		if (result || b->b_refcount > 0) {
+			/* Couldn't clean it, or someone wants it now */
+			b->b_busy = false;
+			cv_broadcast(sfs_bufcv, sfs_buflock);
+			if (result) {
+				return result;
+			}
+			goto again;
+		}
+	}
+
+	if (b->b_fs != NULL) {
+		sfs_buf_hashremove(b);
+		sfs_bufstat_recycles++;
+	}
+	b->b_fs = NULL;
+	b->b_valid = false;
+	*ret = b;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+/*
+ * Find or create the buffer for BLOCK and hand it back busy. If
+ * DOREAD is set, make sure it holds the block's contents. If DOWAIT
+ * is not set and the buffer is busy, fail with EAGAIN instead of
+ * waiting for it.
+ */
+static
+int
+sfs_buf_get(struct sfs_fs *sfs, daddr_t block, bool doread, bool dowait,
+	    struct sfs_buf **ret)
+{
+	struct sfs_buf *b;
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(sfs_buflock != NULL);
+	KASSERT(block < sfs->sfs_sb.sb_nblocks || block == SFS_SUPER_BLOCK);
+
+	lock_acquire(sfs_buflock);
+ again:
+	b = sfs_buf_lookup(sfs, block);
+	if (b != NULL) {
+		if (b->b_busy && !dowait) {
+			lock_release(sfs_buflock);
+			return EAGAIN;
+		}
+		b->b_refcount++;
+		while (b->b_busy) {
+			cv_wait(sfs_bufcv, sfs_buflock);
+		}
+		b->b_refcount--;
+		if (b->b_fs != sfs || b->b_block != block) {
+			/* Recycled while we waited */
+			goto again;
+		}
+		if (b->b_valid) {
+			sfs_bufstat_hits++;
+		}
+	}
+	else {
+		result = sfs_buf_getfree(&b);
+		if (result) {
+			lock_release(sfs_buflock);
+			return result;
+		}
+		if (sfs_buf_lookup(sfs, block) != NULL) {
+			/* Someone else set it up while we cleaned b */
+			b->b_busy = false;
+			cv_broadcast(sfs_bufcv, sfs_buflock);
+			goto again;
+		}
+		b->b_fs = sfs;
+		b->b_block = block;
+		sfs_buf_hashinsert(b);
+	}
+	b->b_busy = true;
+	sfs_buf_lruremove(b);
+	sfs_buf_lrufront(b);
+	lock_release(sfs_buflock);
+
+	if (doread && !b->b_valid) {
+		SFSUIO(&iov, &ku, b->b_data, block, UIO_READ);
+		result = sfs_rwblock(sfs, &ku);
+		if (result) {
+			sfs_brelse(b);
+			return result;
+		}
+		b->b_valid = true;
+		sfs_bufstat_reads++;
+	}
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Get a block's buffer with its contents.
+ */
+int
+sfs_bread(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret)
+{
+	return sfs_buf_get(sfs, block, true, true, ret);
+}
+
+/*
+ * Get a block's buffer without reading it from disk, for a caller
+ * about to overwrite all of it. If the caller gives up before
+ * calling sfs_bdirty, an unread buffer simply stays invalid.
+ */
+int
+sfs_bget(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret)
+{
+	return sfs_buf_get(sfs, block, false, true, ret);
+}
+
+/*
+ * Make sure blocks BLOCK through BLOCK+NBLOCKS-1 are in the cache,
+ * reading each run of missing ones in a single device request.
+ * Blocks that are already cached, or allocated but uninitialized,
+ * are left alone. Only the first buffer of a run is waited for; a
+ * busy one after that ends the run, so we never sleep holding some
+ * buffers while wanting another.
+ */
+int
+sfs_bread_cluster(struct sfs_fs *sfs, daddr_t block, unsigned nblocks)
+{
+	struct sfs_buf *bufs[SFS_BUF_CLUSTER];
+	struct sfs_buf *b;
+	unsigned i, n;
+	int result;
+
+	i = 0;
+	while (i < nblocks) {
+		/* Gather a run of buffers that need reading */
+		n = 0;
+		while (n < SFS_BUF_CLUSTER && i + n < nblocks) {
+			if (sfs_buninit(sfs, block + i + n)) {
+				break;
+			}
+			result = sfs_buf_get(sfs, block + i + n, false,
+					     n == 0, &b);
+			if (result) {
+				break;
+			}
+			if (b->b_valid) {
+				sfs_brelse(b);
+				break;
+			}
+			bufs[n++] = b;
+		}
+		if (n == 0) {
+			/* Nothing to read here; skip this block */
+			i++;
+			continue;
+		}
+
+		result = sfs_buf_rwcluster(bufs, n, UIO_READ);
+		lock_acquire(sfs_buflock);
+		while (n > 0) {
+			b = bufs[--n];
+			if (result == 0) {
+				b->b_valid = true;
+				sfs_bufstat_reads++;
+				i++;
+			}
+			b->b_busy = false;
+		}
+		cv_broadcast(sfs_bufcv, sfs_buflock);
+		lock_release(sfs_buflock);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Release a buffer obtained from sfs_bread or sfs_bget.
+ */
+void
+sfs_brelse(struct sfs_buf *b)
+{
+	lock_acquire(sfs_buflock);
+	KASSERT(b->b_busy);
+	b->b_busy = false;
+	cv_broadcast(sfs_bufcv, sfs_buflock);
+	lock_release(sfs_buflock);
+}
+
+/*
+ * Access a busy buffer's contents.
+ */
+void *
+sfs_bdata(struct sfs_buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+/*
+ * True if a busy buffer holds the block's contents.
+ */
+bool
+sfs_bvalid(struct sfs_buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_valid;
+}
+
+/*
+ * Note that a busy buffer's contents are complete and newer than
+ * what is on disk.
+ */
+void
+sfs_bdirty(struct sfs_buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_valid = true;
+	b->b_dirty = true;
+}
+
+/*
+ * Forget a block that has just been freed: any cached contents,
+ * dirty or not, are stale.
+ */
+void
+sfs_binval(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *b;
+
+	lock_acquire(sfs_buflock);
+	b = sfs_buf_lookup(sfs, block);
+	if (b != NULL) {
+		b->b_refcount++;
+		while (b->b_busy) {
+			cv_wait(sfs_bufcv, sfs_buflock);
+		}
+		b->b_refcount--;
+		if (b->b_fs == sfs && b->b_block == block) {
+			b->b_valid = false;
+			b->b_dirty = false;
+		}
+	}
+	lock_release(sfs_buflock);
+}
+
+/*
+ * Write back all dirty buffers of a volume.
+ *
+ * The list can be rearranged while a write is in progress, so when a
+ * pass writes anything we go around again until a pass finds
+ * nothing to do.
+ */
+int
+sfs_bsync(struct sfs_fs *sfs)
+{
+	struct sfs_buf *b, *next;
+	bool wrote;
+	int result;
+
+	lock_acquire(sfs_buflock);
+	do {
+		wrote = false;
+		for (b = sfs_buflru_head; b != NULL; b = next) {
+			if (b->b_fs != sfs || !b->b_dirty) {
+				next = b->b_lrunext;
+				continue;
+			}
+			b->b_refcount++;
+			while (b->b_busy) {
+				cv_wait(sfs_bufcv, sfs_buflock);
+			}
+			if (b->b_fs == sfs && b->b_dirty) {
+				b->b_busy = true;
+				result = sfs_buf_writeout(b);
+				b->b_busy = false;
+				cv_broadcast(sfs_bufcv, sfs_buflock);
+				if (result) {
+					b->b_refcount--;
+					lock_release(sfs_buflock);
+					return result;
+				}
+				wrote = true;
+			}
+			next = b->b_lrunext;
+			b->b_refcount--;
+		}
+	} while (wrote);
+	lock_release(sfs_buflock);
+	return 0;
+}
+
+/*
+ * Drop every buffer of a volume that is going away. The volume must
+ * have been synced (or never written).
+ */
+void
+sfs_bpurge(struct sfs_fs *sfs)
+{
+	struct sfs_buf *b;
+
+	if (sfs_buflock == NULL) {
+		return;
+	}
+
+	lock_acquire(sfs_buflock);
+	for (b = sfs_buflru_head; b != NULL; b = b->b_lrunext) {
+		if (b->b_fs != sfs) {
+			continue;
+		}
+		KASSERT(!b->b_busy && b->b_refcount == 0);
+		KASSERT(!b->b_dirty);
+		sfs_buf_hashremove(b);
+		b->b_fs = NULL;
+		b->b_valid = false;
+	}
+	lock_release(sfs_buflock);
+}
+
+/*
+ * Print buffer cache statistics.
+ */
+void
+sfs_bufstats(void)
+{
+	kprintf("sfs buffer cache: %u buffers (%u KB)\n", sfs_nbufs,
+		sfs_nbufs * SFS_BLOCKSIZE / 1024);
+	kprintf("    %u hits, %u disk reads, %u disk writes, "
+		"%u recycled\n", sfs_bufstat_hits, sfs_bufstat_reads,
+		sfs_bufstat_writes, sfs_bufstat_recycles);
+}
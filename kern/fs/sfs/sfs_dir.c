@@ -35,6 +35,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -95,14 +96,222 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_direntry);
 }
 
+////////////////////////////////////////////////////////////
+//
+// Name hash
+//
+// The first lookup in a directory reads all its entries once and
+// builds an in-memory hash of name -> (inode, slot), plus a list of
+// the empty slots. sfs_dir_link and sfs_dir_unlink keep it up to
+// date, so after that lookups, creates and removes don't scan the
+// directory. If memory runs out while building or updating, the
+// hash is simply thrown away and we fall back to scanning until the
+// next lookup rebuilds it.
+
+/* Initial number of buckets; doubled when the load passes 2 */
+#define SFS_DIRHASH_MINBUCKETS	16
+
+struct sfs_dhent {
+	struct sfs_dhent *de_next;	/* Bucket chain, or free list */
+	int de_slot;			/* Slot in the directory */
+	uint32_t de_ino;		/* Inode number (unused if free) */
+	char de_name[SFS_NAMELEN];	/* Name (unused if free) */
+};
+
+struct sfs_dirhash {
+	struct sfs_dhent **dh_buckets;
+	unsigned dh_nbuckets;
+	unsigned dh_nentries;
+	struct sfs_dhent *dh_free;	/* Empty slots */
+};
+
+static
+unsigned
+sfs_dirhash_fn(const char *name, unsigned nbuckets)
+{
+	unsigned h = 5381;
+
+	while (*name != 0) {
+		h = h * 33 + (unsigned char)*name++;
+	}
+	return h % nbuckets;
+}
+
 /*
- * Search a directory for a particular filename in a directory, and
- * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * Throw away a directory's name hash, if it has one.
+ */
+void
+sfs_dirhash_destroy(struct sfs_vnode *sv)
+{
+	struct sfs_dirhash *dh = sv->sv_dirhash;
+	struct sfs_dhent *de;
+	unsigned i;
+
+	if (dh == NULL) {
+		return;
+	}
+	for (i=0; i<dh->dh_nbuckets; i++) {
+		while ((de = dh->dh_buckets[i]) != NULL) {
+			dh->dh_buckets[i] = de->de_next;
+			kfree(de);
+		}
+	}
+	while ((de = dh->dh_free) != NULL) {
+		dh->dh_free = de->de_next;
+		kfree(de);
+	}
+	kfree(dh->dh_buckets);
+	kfree(dh);
+	sv->sv_dirhash = NULL;
+}
+
+/*
+ * Double the number of buckets. Failing is harmless; the chains just
+ * get longer.
+ */
+static
+void
+sfs_dirhash_grow(struct sfs_dirhash *dh)
+{
+	struct sfs_dhent **nb;
+	struct sfs_dhent *de;
+	unsigned i, n, h;
+
+	n = dh->dh_nbuckets * 2;
+	nb = kmalloc(n * sizeof(*nb));
+	if (nb == NULL) {
+		return;
+	}
+	for (i=0; i<n; i++) {
+		nb[i] = NULL;
+	}
+	for (i=0; i<dh->dh_nbuckets; i++) {
+		while ((de = dh->dh_buckets[i]) != NULL) {
+			dh->dh_buckets[i] = de->de_next;
+			h = sfs_dirhash_fn(de->de_name, n);
+			de->de_next = nb[h];
+			nb[h] = de;
+		}
+	}
+	kfree(dh->dh_buckets);
+	dh->dh_buckets = nb;
+	dh->dh_nbuckets = n;
+}
+
+/*
+ * Record directory entry SD in slot SLOT. Returns ENOMEM if out of
+ * memory.
  */
+static
 int
-sfs_dir_findname(struct sfs_vnode *sv, const char *name,
-		uint32_t *ino, int *slot, int *emptyslot)
+sfs_dirhash_add(struct sfs_dirhash *dh, int slot,
+		const struct sfs_direntry *sd)
+{
+	struct sfs_dhent *de;
+	unsigned h;
+
+	de = kmalloc(sizeof(*de));
+	if (de == NULL) {
+		return ENOMEM;
+	}
+	de->de_slot = slot;
+	de->de_ino = sd->sfd_ino;
+	if (sd->sfd_ino == SFS_NOINO) {
+		de->de_next = dh->dh_free;
+		dh->dh_free = de;
+		return 0;
+	}
+	strcpy(de->de_name, sd->sfd_name);
+	h = sfs_dirhash_fn(de->de_name, dh->dh_nbuckets);
+	de->de_next = dh->dh_buckets[h];
+	dh->dh_buckets[h] = de;
+	dh->dh_nentries++;
+	if (dh->dh_nentries > 2 * dh->dh_nbuckets) {
+		sfs_dirhash_grow(dh);
+	}
+	return 0;
+}
+
+/*
+ * Find NAME's entry; hand back the pointer to it in its chain so the
+ * caller can unlink it.
+ */
+static
+struct sfs_dhent **
+sfs_dirhash_find(struct sfs_dirhash *dh, const char *name)
+{
+	struct sfs_dhent **pp;
+
+	pp = &dh->dh_buckets[sfs_dirhash_fn(name, dh->dh_nbuckets)];
+	while (*pp != NULL) {
+		if (!strcmp((*pp)->de_name, name)) {
+			return pp;
+		}
+		pp = &(*pp)->de_next;
+	}
+	return NULL;
+}
+
+/*
+ * Build the name hash for a directory. Fails only on I/O errors;
+ * running out of memory just leaves the directory without a hash.
+ */
+static
+int
+sfs_dirhash_build(struct sfs_vnode *sv)
+{
+	struct sfs_dirhash *dh;
+	struct sfs_direntry tsd;
+	int nentries, i, result;
+	unsigned j;
+
+	KASSERT(sv->sv_dirhash == NULL);
+
+	dh = kmalloc(sizeof(*dh));
+	if (dh == NULL) {
+		return 0;
+	}
+	dh->dh_nbuckets = SFS_DIRHASH_MINBUCKETS;
+	dh->dh_buckets = kmalloc(dh->dh_nbuckets * sizeof(*dh->dh_buckets));
+	if (dh->dh_buckets == NULL) {
+		kfree(dh);
+		return 0;
+	}
+	for (j=0; j<dh->dh_nbuckets; j++) {
+		dh->dh_buckets[j] = NULL;
+	}
+	dh->dh_nentries = 0;
+	dh->dh_free = NULL;
+	sv->sv_dirhash = dh;
+
+	nentries = sfs_dir_nentries(sv);
+	for (i=0; i<nentries; i++) {
+		result = sfs_readdir(sv, i, &tsd);
+		if (result) {
+			sfs_dirhash_destroy(sv);
+			return result;
+		}
+		/* Ensure null termination, just in case */
+		tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+		/* Each name may legally appear only once... */
+		KASSERT(tsd.sfd_ino == SFS_NOINO ||
+			sfs_dirhash_find(dh, tsd.sfd_name) == NULL);
+		if (sfs_dirhash_add(dh, i, &tsd)) {
+			sfs_dirhash_destroy(sv);
+			return 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Search a directory by scanning every slot. Used when the name
+ * hash can't be built.
+ */
+static
+int
+sfs_dir_scan(struct sfs_vnode *sv, const char *name,
+	     uint32_t *ino, int *slot, int *emptyslot)
 {
 	struct sfs_direntry tsd;
 	int found, nentries, i, result;
@@ -146,6 +355,47 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 	return found ? 0 : ENOENT;
 }
 
+/*
+ * Search a directory for a particular filename in a directory, and
+ * return its inode number, its slot, and/or the slot number of an
+ * empty directory slot if one is found.
+ */
+int
+sfs_dir_findname(struct sfs_vnode *sv, const char *name,
+		uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_dhent **pp;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_dirhash == NULL) {
+		result = sfs_dirhash_build(sv);
+		if (result) {
+			return result;
+		}
+		if (sv->sv_dirhash == NULL) {
+			return sfs_dir_scan(sv, name, ino, slot, emptyslot);
+		}
+	}
+
+	if (emptyslot != NULL && sv->sv_dirhash->dh_free != NULL) {
+		*emptyslot = sv->sv_dirhash->dh_free->de_slot;
+	}
+
+	pp = sfs_dirhash_find(sv->sv_dirhash, name);
+	if (pp == NULL) {
+		return ENOENT;
+	}
+	if (slot != NULL) {
+		*slot = (*pp)->de_slot;
+	}
+	if (ino != NULL) {
+		*ino = (*pp)->de_ino;
+	}
+	return 0;
+}
+
 /*
  * Create a link in a directory to the specified inode by number, with
  * the specified name, and optionally hand back the slot.
@@ -153,6 +403,8 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 int
 sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 {
+	struct sfs_dirhash *dh;
+	struct sfs_dhent *de;
 	int emptyslot = -1;
 	int result;
 	struct sfs_direntry sd;
@@ -186,7 +438,24 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, emptyslot, &sd);
+	result = sfs_writedir(sv, emptyslot, &sd);
+	if (result) {
+		return result;
+	}
+
+	/* Keep the hash in step: the slot is no longer free */
+	dh = sv->sv_dirhash;
+	if (dh != NULL) {
+		de = dh->dh_free;
+		if (de != NULL && de->de_slot == emptyslot) {
+			dh->dh_free = de->de_next;
+			kfree(de);
+		}
+		if (sfs_dirhash_add(dh, emptyslot, &sd)) {
+			sfs_dirhash_destroy(sv);
+		}
+	}
+	return 0;
 }
 
 /*
@@ -195,14 +464,48 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
-	struct sfs_direntry sd;
+	struct sfs_dirhash *dh;
+	struct sfs_dhent **pp, *de;
+	struct sfs_direntry sd, oldsd;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	/*
+	 * If there's a hash, get the name that's going away so we
+	 * can find its hash entry.
+	 */
+	dh = sv->sv_dirhash;
+	if (dh != NULL) {
+		result = sfs_readdir(sv, slot, &oldsd);
+		if (result) {
+			return result;
+		}
+		oldsd.sfd_name[sizeof(oldsd.sfd_name)-1] = 0;
+	}
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, slot, &sd);
+	result = sfs_writedir(sv, slot, &sd);
+	if (result) {
+		return result;
+	}
+
+	/* Move the name's hash entry to the free list */
+	if (dh != NULL) {
+		pp = sfs_dirhash_find(dh, oldsd.sfd_name);
+		KASSERT(pp != NULL && (*pp)->de_slot == slot);
+		de = *pp;
+		*pp = de->de_next;
+		dh->dh_nentries--;
+		de->de_ino = SFS_NOINO;
+		de->de_next = dh->dh_free;
+		dh->dh_free = de;
+	}
+	return 0;
 }
 
 /*
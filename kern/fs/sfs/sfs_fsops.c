@@ -36,8 +36,8 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
-#include <array.h>
 #include <bitmap.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
@@ -51,9 +51,11 @@
 #define SFS_FS_FREEMAPBLOCKS(sfs)  SFS_FREEMAPBLOCKS(SFS_FS_NBLOCKS(sfs))
 
 /*
- * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Routines for doing I/O on the free block bitmap. It is read in
+ * whole at mount time; after that, each block of it is written only
+ * when something in it has changed (see sfs_sync). The freemap
+ * bypasses the buffer cache, because the cache writes it out before
+ * writing back any other buffer (sfs_buf.c).
  *
  * The free block bitmap consists of SFS_FREEMAPBLOCKS 512-byte
  * sectors of bits, one bit for each sector on the filesystem. The
@@ -69,8 +71,10 @@
  */
 static
 int
-sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
+sfs_freemap_read(struct sfs_fs *sfs)
 {
+	struct iovec iov;
+	struct uio ku;
 	uint32_t j, freemapblocks;
 	char *freemapdata;
 	int result;
@@ -87,15 +91,9 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 		/* Get a pointer to its data */
 		void *ptr = freemapdata + j*SFS_BLOCKSIZE;
 
-		/* and read or write it. The freemap starts at sector 2. */
-		if (rw == UIO_READ) {
-			result = sfs_readblock(sfs, SFS_FREEMAP_START+j, ptr,
-					       SFS_BLOCKSIZE);
-		}
-		else {
-			result = sfs_writeblock(sfs, SFS_FREEMAP_START+j, ptr,
-						SFS_BLOCKSIZE);
-		}
+		/* and read it. The freemap starts at sector 2. */
+		SFSUIO(&iov, &ku, ptr, SFS_FREEMAP_START+j, UIO_READ);
+		result = sfs_rwblock(sfs, &ku);
 
 		/* If we failed, stop. */
 		if (result) {
@@ -105,40 +103,139 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 	return 0;
 }
 
+/*
+ * Write block J of the freemap straight to disk. Blocks freed but
+ * not yet released by sfs_sync are written as still in use. Call
+ * with sfs_fmiolock held; the block is put together in sfs_fmbuf.
+ */
+static
+int
+sfs_freemap_write(struct sfs_fs *sfs, uint32_t j)
+{
+	struct iovec iov;
+	struct uio ku;
+	const uint8_t *map, *freed, *freeing;
+	uint8_t *data;
+	uint32_t i;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_fmiolock));
+	data = (uint8_t *)sfs->sfs_fmbuf;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	map = bitmap_getdata(sfs->sfs_freemap);
+	freed = bitmap_getdata(sfs->sfs_freed);
+	freeing = bitmap_getdata(sfs->sfs_freeing);
+	for (i = j*SFS_BLOCKSIZE; i < (j+1)*SFS_BLOCKSIZE; i++) {
+		data[i - j*SFS_BLOCKSIZE] = map[i] | freed[i] | freeing[i];
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	SFSUIO(&iov, &ku, data, SFS_FREEMAP_START+j, UIO_WRITE);
+	return sfs_rwblock(sfs, &ku);
+}
+
+/*
+ * Return the first vnode in the table at or after SV (or, if SV is
+ * NULL, at or after bucket I) that isn't being reclaimed, with a
+ * reference held. Call with sfs_vnlock held.
+ */
+static
+struct sfs_vnode *
+sfs_sync_nextvnode(struct sfs_fs *sfs, struct sfs_vnode *sv, unsigned i)
+{
+	while (1) {
+		while (sv != NULL && sv->sv_reclaiming) {
+			sv = sv->sv_hashnext;
+		}
+		if (sv != NULL) {
+			VOP_INCREF(&sv->sv_absvn);
+			return sv;
+		}
+		if (++i >= SFS_VNHASH_SIZE) {
+			return NULL;
+		}
+		sv = sfs->sfs_vnhash[i];
+	}
+}
+
 /*
  * Sync routine for the vnode table.
+ *
+ * VOP_FSYNC takes the vnode's lock, which comes before sfs_vnlock,
+ * so we can't call it while walking the table. Instead hold a
+ * reference to the vnode being synced, which keeps it (and thus its
+ * place in the chain) from going away while we don't hold the lock.
  */
 static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
-	unsigned i, num;
-
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+	struct sfs_vnode *sv, *next;
+	unsigned i;
+
+	lock_acquire(sfs->sfs_vnlock);
+	sv = sfs_sync_nextvnode(sfs, sfs->sfs_vnhash[0], 0);
+	while (sv != NULL) {
+		lock_release(sfs->sfs_vnlock);
+		VOP_FSYNC(&sv->sv_absvn);
+		lock_acquire(sfs->sfs_vnlock);
+		i = SFS_VNHASH(sv->sv_ino);
+		next = sfs_sync_nextvnode(sfs, sv->sv_hashnext, i);
+		lock_release(sfs->sfs_vnlock);
+		/* This may reclaim it, which takes sfs_vnlock */
+		VOP_DECREF(&sv->sv_absvn);
+		lock_acquire(sfs->sfs_vnlock);
+		sv = next;
 	}
+	lock_release(sfs->sfs_vnlock);
 	return 0;
 }
 
 /*
- * Sync routine for the freemap.
+ * Sync routine for the freemap: write the blocks of it that have
+ * changed. Also called by the buffer cache before it writes back a
+ * buffer, so that every block the buffer might point at is shown in
+ * use on disk first. Holding sfs_fmiolock throughout means that when
+ * this returns, whatever was marked dirty on entry is on disk, even
+ * if another thread was partway through writing it.
  */
-static
 int
 sfs_sync_freemap(struct sfs_fs *sfs)
 {
+	uint32_t j;
+	bool dirty;
 	int result;
 
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_freemapio(sfs, UIO_WRITE);
+	lock_acquire(sfs->sfs_fmiolock);
+	for (j=0; j<SFS_FS_FREEMAPBLOCKS(sfs); j++) {
+		/*
+		 * Clear the bit before copying, so a change made while
+		 * we write sets it again and is picked up next time.
+		 */
+		lock_acquire(sfs->sfs_freemaplock);
+		dirty = bitmap_isset(sfs->sfs_fmdirty, j);
+		if (dirty) {
+			bitmap_unmark(sfs->sfs_fmdirty, j);
+			sfs->sfs_nfmdirty--;
+		}
+		lock_release(sfs->sfs_freemaplock);
+
+		if (!dirty) {
+			continue;
+		}
+		result = sfs_freemap_write(sfs, j);
 		if (result) {
+			lock_acquire(sfs->sfs_freemaplock);
+			if (!bitmap_isset(sfs->sfs_fmdirty, j)) {
+				bitmap_mark(sfs->sfs_fmdirty, j);
+				sfs->sfs_nfmdirty++;
+			}
+			lock_release(sfs->sfs_freemaplock);
+			lock_release(sfs->sfs_fmiolock);
 			return result;
 		}
-		sfs->sfs_freemapdirty = false;
 	}
+	lock_release(sfs->sfs_fmiolock);
 
 	return 0;
 }
@@ -165,7 +262,38 @@ sfs_sync_superblock(struct sfs_fs *sfs)
 
 /*
  * Sync routine. This is what gets invoked if you do FS_SYNC on the
- * sfs filesystem structure.
+ * sfs filesystem structure, and what the syncer thread runs every
+ * few seconds.
+ *
+ * The writes are ordered so that what is on disk is consistent (to
+ * sfsck) at every point, except that blocks may be marked in use
+ * that nothing points to:
+ *
+ *    1. Blocks allocated but never written are zeroed, before
+ *       anything pointing at them is written.
+ *    2. Changed freemap blocks are written, with blocks freed since
+ *       the last sync still marked in use. Blocks allocated so far
+ *       are now shown as such on disk before the inodes and indirect
+ *       blocks that refer to them go out.
+ *    3. Inodes, the superblock, and the rest of the buffer cache are
+ *       written.
+ *    4. Now that no inode or indirect block on disk points at the
+ *       blocks freed before step 2, they are written as free.
+ *
+ * Step 2 starts by collecting the frees to be released in step 4.
+ * It takes sfs_freelock for writing to do so; whoever frees blocks
+ * holds it for reading until the metadata that let go of them is in
+ * the buffer cache, so that metadata is sure to be written in step
+ * 3. Freed blocks aren't reused until released, since their old
+ * owner may still point at them on disk.
+ *
+ * Blocks allocated and put to use while a sync is in progress are
+ * shown on disk by the next one, or sooner: the buffer cache writes
+ * the changed freemap blocks before writing back any buffer, so an
+ * inode or indirect block recycled early never reaches the disk
+ * ahead of the allocations it records.
+ *
+ * Syncs of a volume are serialized by sfs_synclock.
  */
 static
 int
@@ -174,8 +302,6 @@ sfs_sync(struct fs *fs)
 	struct sfs_fs *sfs;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -208,48 +334,64 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* If any vnodes need to be written, write them. */
-	result = sfs_sync_vnodes(sfs);
+	lock_acquire(sfs->sfs_synclock);
+
+	/* 1. Zero any blocks that were allocated but never written. */
+	result = sfs_binit_all(sfs);
 	if (result) {
-		vfs_biglock_release();
-		return result;
+		goto out;
 	}
 
-	/* If the free block map needs to be written, write it. */
+	/* 2. Write the freemap, holding back what has been freed. */
+	rwlock_acquire_write(sfs->sfs_freelock);
+	sfs_bfree_collect(sfs);
+	rwlock_release_write(sfs->sfs_freelock);
+
 	result = sfs_sync_freemap(sfs);
 	if (result) {
-		vfs_biglock_release();
-		return result;
+		goto out;
+	}
+
+	/* 3. If any vnodes need to be written, write them. */
+	result = sfs_sync_vnodes(sfs);
+	if (result) {
+		goto out;
 	}
 
 	/* If the superblock needs to be written, write it. */
 	result = sfs_sync_superblock(sfs);
 	if (result) {
-		vfs_biglock_release();
-		return result;
+		goto out;
 	}
 
-	vfs_biglock_release();
-	return 0;
+	/* Now push everything above out of the buffer cache. */
+	result = sfs_bsync(sfs);
+	if (result) {
+		goto out;
+	}
+
+	/* 4. Release the blocks collected in step 2. */
+	sfs_bfree_commit(sfs);
+	result = sfs_sync_freemap(sfs);
+
+ out:
+	lock_release(sfs->sfs_synclock);
+	return result;
 }
 
 /*
  * Routine to retrieve the volume name. Filesystems can be referred
  * to by their volume name followed by a colon as well as the name
- * of the device they're mounted on.
+ * of the device they're mounted on. The name doesn't change while
+ * mounted, so no locking.
  */
 static
 const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_sb.sb_volname;
-	vfs_biglock_release();
 
-	return ret;
+	return sfs->sfs_sb.sb_volname;
 }
 
 /*
@@ -259,10 +401,30 @@ static
 void
 sfs_fs_destroy(struct sfs_fs *sfs)
 {
+	sfs_bpurge(sfs);
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
-	vnodearray_destroy(sfs->sfs_vnodes);
+	if (sfs->sfs_fmdirty != NULL) {
+		bitmap_destroy(sfs->sfs_fmdirty);
+	}
+	if (sfs->sfs_freed != NULL) {
+		bitmap_destroy(sfs->sfs_freed);
+	}
+	if (sfs->sfs_freeing != NULL) {
+		bitmap_destroy(sfs->sfs_freeing);
+	}
+	if (sfs->sfs_uninitmap != NULL) {
+		bitmap_destroy(sfs->sfs_uninitmap);
+	}
+	kfree(sfs->sfs_vnhash);
+	rwlock_destroy(sfs->sfs_freelock);
+	lock_destroy(sfs->sfs_synclock);
+	lock_destroy(sfs->sfs_freemaplock);
+	kfree(sfs->sfs_fmbuf);
+	lock_destroy(sfs->sfs_fmiolock);
+	cv_destroy(sfs->sfs_vncv);
+	lock_destroy(sfs->sfs_vnlock);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -270,25 +432,46 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 /*
  * Unmount code.
  *
- * VFS calls FS_SYNC on the filesystem prior to unmounting it.
+ * VFS calls FS_SYNC on the filesystem prior to unmounting it. Both
+ * are called with vfs_biglock held, which keeps new lookups from
+ * reaching the volume through the mount table; once no vnodes are
+ * loaded, nothing else can be using it.
  */
 static
 int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
-	vfs_biglock_acquire();
+	KASSERT(vfs_biglock_do_i_hold());
 
 	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
-	/* We should have just had sfs_sync called. */
+	/*
+	 * We should have just had sfs_sync called, but files closed
+	 * while it ran may have freed blocks it didn't get to release.
+	 * Nothing can change now, so one more pass finishes the job.
+	 */
+	result = sfs_sync(fs);
+	if (result) {
+		return result;
+	}
 	KASSERT(sfs->sfs_superdirty == false);
-	KASSERT(sfs->sfs_freemapdirty == false);
+	KASSERT(sfs->sfs_nfmdirty == 0);
+	KASSERT(sfs->sfs_nuninit == 0);
+
+	/* Stop the syncer looking at us */
+	sfs_syncer_remove(sfs);
+
+	/* Drop any read-ahead still queued for us */
+	sfs_ra_purge(sfs);
 
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
@@ -297,7 +480,6 @@ sfs_unmount(struct fs *fs)
 	sfs_fs_destroy(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -321,6 +503,7 @@ struct sfs_fs *
 sfs_fs_create(void)
 {
 	struct sfs_fs *sfs;
+	unsigned i;
 
 	/*
 	 * Make sure our on-disk structures aren't messed up
@@ -351,17 +534,72 @@ sfs_fs_create(void)
 	sfs->sfs_device = NULL;
 
 	/* vnode table */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	sfs->sfs_vnlock = lock_create("sfs_vnlock");
+	if (sfs->sfs_vnlock == NULL) {
 		goto cleanup_object;
 	}
+	sfs->sfs_vncv = cv_create("sfs_vncv");
+	if (sfs->sfs_vncv == NULL) {
+		goto cleanup_vnlock;
+	}
+	sfs->sfs_vnhash = kmalloc(SFS_VNHASH_SIZE * sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vnhash == NULL) {
+		goto cleanup_vncv;
+	}
+	for (i=0; i<SFS_VNHASH_SIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_nvnodes = 0;
 
 	/* freemap */
+	sfs->sfs_fmiolock = lock_create("sfs_fmiolock");
+	if (sfs->sfs_fmiolock == NULL) {
+		goto cleanup_vnhash;
+	}
+	sfs->sfs_fmbuf = kmalloc(SFS_BLOCKSIZE);
+	if (sfs->sfs_fmbuf == NULL) {
+		goto cleanup_fmiolock;
+	}
+	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_fmbuf;
+	}
 	sfs->sfs_freemap = NULL;
-	sfs->sfs_freemapdirty = false;
+	sfs->sfs_fmdirty = NULL;
+	sfs->sfs_nfmdirty = 0;
+	sfs->sfs_freed = NULL;
+	sfs->sfs_freeing = NULL;
+	sfs->sfs_uninitmap = NULL;
+	sfs->sfs_nuninit = 0;
+	sfs->sfs_palist = NULL;
+
+	/* sync */
+	sfs->sfs_synclock = lock_create("sfs_synclock");
+	if (sfs->sfs_synclock == NULL) {
+		goto cleanup_freemaplock;
+	}
+	sfs->sfs_freelock = rwlock_create("sfs_freelock");
+	if (sfs->sfs_freelock == NULL) {
+		goto cleanup_synclock;
+	}
+	sfs->sfs_syncnext = NULL;
 
 	return sfs;
 
+cleanup_synclock:
+	lock_destroy(sfs->sfs_synclock);
+cleanup_freemaplock:
+	lock_destroy(sfs->sfs_freemaplock);
+cleanup_fmbuf:
+	kfree(sfs->sfs_fmbuf);
+cleanup_fmiolock:
+	lock_destroy(sfs->sfs_fmiolock);
+cleanup_vnhash:
+	kfree(sfs->sfs_vnhash);
+cleanup_vncv:
+	cv_destroy(sfs->sfs_vncv);
+cleanup_vnlock:
+	lock_destroy(sfs->sfs_vnlock);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -388,7 +626,8 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
+	/* vfs_mount holds vfs_biglock, which serializes mounting */
+	KASSERT(vfs_biglock_do_i_hold());
 
 	/* We don't pass any options through mount */
 	(void)options;
@@ -402,15 +641,28 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		kprintf("sfs: Cannot mount on device with blocksize %zu\n",
 			dev->d_blocksize);
 		return ENXIO;
 	}
 
+	result = sfs_buf_bootstrap();
+	if (result) {
+		return result;
+	}
+
+	result = sfs_ra_bootstrap();
+	if (result) {
+		return result;
+	}
+
+	result = sfs_syncer_bootstrap();
+	if (result) {
+		return result;
+	}
+
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
@@ -423,7 +675,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -436,7 +687,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			SFS_MAGIC);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
@@ -453,21 +703,36 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	if (sfs->sfs_freemap == NULL) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
-	result = sfs_freemapio(sfs, UIO_READ);
+	result = sfs_freemap_read(sfs);
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
+	/*
+	 * Nothing is dirty, freed, or uninitialized on a freshly
+	 * mounted volume
+	 */
+	sfs->sfs_fmdirty = bitmap_create(SFS_FS_FREEMAPBLOCKS(sfs));
+	sfs->sfs_freed = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
+	sfs->sfs_freeing = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
+	sfs->sfs_uninitmap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
+	if (sfs->sfs_fmdirty == NULL || sfs->sfs_freed == NULL ||
+	    sfs->sfs_freeing == NULL || sfs->sfs_uninitmap == NULL) {
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return ENOMEM;
+	}
+
+	/* Have it synced periodically */
+	sfs_syncer_add(sfs);
+
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
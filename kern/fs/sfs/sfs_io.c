@@ -35,6 +35,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
@@ -54,16 +55,16 @@
 
 /*
  * Read or write a block, retrying I/O errors.
+ *
+ * This goes straight to the device; everything else uses the buffer
+ * cache (sfs_buf.c), which calls this.
  */
-static
 int
 sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 {
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n",
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
@@ -102,39 +103,75 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 }
 
 /*
- * Read a block.
+ * Read a block (through the buffer cache).
  */
 int
 sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct sfs_buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_bread(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(data, sfs_bdata(buf), len);
+	sfs_brelse(buf);
+	return 0;
 }
 
 /*
- * Write a block.
+ * Write a block (into the buffer cache; it reaches the disk on
+ * write-back).
  */
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct sfs_buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_bget(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(sfs_bdata(buf), data, len);
+	sfs_bdirty(buf);
+	sfs_brelse(buf);
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
 
+/*
+ * Get a block's buffer in order to change part of it. A block that
+ * was allocated but never written has nothing worth reading, so we
+ * start from zeros instead of going to disk; the caller must mark
+ * the buffer dirty.
+ */
+static
+int
+sfs_bmodify(struct sfs_fs *sfs, daddr_t diskblock, struct sfs_buf **ret)
+{
+	int result;
+
+	if (!sfs_buninit(sfs, diskblock)) {
+		return sfs_bread(sfs, diskblock, ret);
+	}
+	result = sfs_bget(sfs, diskblock, ret);
+	if (result) {
+		return result;
+	}
+	bzero(sfs_bdata(*ret), SFS_BLOCKSIZE);
+	sfs_binit(sfs, diskblock);
+	return 0;
+}
+
 /*
  * Do I/O to a block of a file that doesn't cover the whole block.  We
  * need to read in the original block first, even if we're writing, so
@@ -150,16 +187,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -169,9 +198,6 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
@@ -184,40 +210,42 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
+		return uiomovezeros(len, uio);
 	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+
+	if (uio->uio_rw == UIO_READ && sfs_buninit(sfs, diskblock)) {
+		/* Allocated but never written; it reads as zeros too. */
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	if (uio->uio_rw == UIO_READ) {
+		result = sfs_bread(sfs, diskblock, &buf);
+	}
+	else {
+		result = sfs_bmodify(sfs, diskblock, &buf);
+	}
 	if (result) {
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 * If it was a write, the buffer is now dirty, even if uiomove
+	 * only got partway.
 	 */
+	result = uiomove((char *)sfs_bdata(buf) + skipstart, len, uio);
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		sfs_bdirty(buf);
 	}
+	sfs_brelse(buf);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -228,14 +256,12 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
+	bool wasvalid;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -257,45 +283,114 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		return uiomovezeros(SFS_BLOCKSIZE, uio);
 	}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
 
-	result = sfs_rwblock(sfs, uio);
+	if (uio->uio_rw == UIO_READ) {
+		if (sfs_buninit(sfs, diskblock)) {
+			return uiomovezeros(SFS_BLOCKSIZE, uio);
+		}
+		result = sfs_bread(sfs, diskblock, &buf);
+		if (result) {
+			return result;
+		}
+		result = uiomove(sfs_bdata(buf), SFS_BLOCKSIZE, uio);
+		sfs_brelse(buf);
+		return result;
+	}
 
 	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
+	 * Writing the whole block: no need to read it first, nor to
+	 * have zeroed it when it was allocated. If the copy fails
+	 * partway, a buffer that already held the block keeps what
+	 * was copied (as with a short write); one that didn't stays
+	 * invalid, so nothing half-filled reaches disk, and a freshly
+	 * allocated block stays uninitialized.
 	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
-
+	result = sfs_bget(sfs, diskblock, &buf);
+	if (result) {
+		return result;
+	}
+	wasvalid = sfs_bvalid(buf);
+	result = uiomove(sfs_bdata(buf), SFS_BLOCKSIZE, uio);
+	if (result == 0 || wasvalid) {
+		sfs_bdirty(buf);
+	}
+	if (result == 0) {
+		sfs_binit(sfs, diskblock);
+	}
+	sfs_brelse(buf);
 	return result;
 }
 
+/*
+ * Before reading whole blocks starting at FILEBLOCK, find how many of
+ * the next NBLOCKS (at least one) lie in a run of consecutive disk
+ * blocks, and bring that run into the buffer cache with as few device
+ * requests as possible. The caller then reads the run a block at a
+ * time from the cache. Holes end a run.
+ *
+ * Runs are cut at SFS_BUF_CLUSTER blocks, and the caller comes back
+ * for the next piece once it has copied this one out, so a read
+ * bigger than the cache doesn't push out its own first blocks
+ * before getting to them.
+ */
+static
+int
+sfs_clusterread(struct sfs_vnode *sv, uint32_t fileblock, uint32_t nblocks,
+		uint32_t *runlen)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t first, next;
+	uint32_t len;
+	int result;
+
+	KASSERT(nblocks > 0);
+	if (nblocks > SFS_BUF_CLUSTER) {
+		nblocks = SFS_BUF_CLUSTER;
+	}
+
+	result = sfs_bmap(sv, fileblock, false, &first);
+	if (result) {
+		return result;
+	}
+	if (first == 0) {
+		*runlen = 1;
+		return 0;
+	}
+
+	for (len = 1; len < nblocks; len++) {
+		result = sfs_bmap(sv, fileblock + len, false, &next);
+		if (result) {
+			return result;
+		}
+		if (next != first + len) {
+			break;
+		}
+	}
+
+	*runlen = len;
+	return sfs_bread_cluster(sfs, first, len);
+}
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
+ *
+ * UIO must refer to kernel memory: the copy is done with the vnode
+ * lock and a buffer held, and may not fault. sfs_read and sfs_write
+ * bounce user data through a kernel buffer.
  */
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
 	uint32_t blkoff;
 	uint32_t nblocks, i;
+	uint32_t runend, runlen;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(uio->uio_segflg == UIO_SYSSPACE);
+
 	origresid = uio->uio_resid;
 
 	/*
@@ -349,10 +444,24 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 
 	/*
 	 * Now we should be block-aligned. Do the remaining whole blocks.
+	 *
+	 * When reading, fetch each run of blocks that are contiguous
+	 * on disk in one go first. Writes just fill cache buffers; the
+	 * cache clusters them when it writes them back.
 	 */
 	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
 	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
+	runend = 0;
 	for (i=0; i<nblocks; i++) {
+		if (uio->uio_rw == UIO_READ && i == runend) {
+			result = sfs_clusterread(sv,
+					uio->uio_offset / SFS_BLOCKSIZE,
+					nblocks - i, &runlen);
+			if (result) {
+				goto out;
+			}
+			runend = i + runlen;
+		}
 		result = sfs_blockio(sv, uio);
 		if (result) {
 			goto out;
@@ -407,6 +516,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	   enum uio_rw rw)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	off_t endpos;
 	uint32_t vnblock;
 	uint32_t blockoffset;
@@ -414,17 +524,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
@@ -446,26 +546,33 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	if (rw == UIO_READ && sfs_buninit(sfs, diskblock)) {
+		/* Allocated but never written; also zeros. */
+		bzero(data, len);
+		return 0;
+	}
+
+	/* Get the block */
+	if (rw == UIO_READ) {
+		result = sfs_bread(sfs, diskblock, &buf);
+	}
+	else {
+		result = sfs_bmodify(sfs, diskblock, &buf);
+	}
 	if (result) {
 		return result;
 	}
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, (char *)sfs_bdata(buf) + blockoffset, len);
+		sfs_brelse(buf);
 	}
 	else {
 		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		memcpy((char *)sfs_bdata(buf) + blockoffset, data, len);
+		sfs_bdirty(buf);
+		sfs_brelse(buf);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
@@ -0,0 +1,254 @@
+/*
+ * SFS filesystem
+ *
+ * Sequential read-ahead.
+ *
+ * Each vnode remembers where the last read ended. A read that starts
+ * there is sequential: the read-ahead window for the file opens at
+ * SFS_RA_MIN blocks and doubles with each further sequential read,
+ * up to SFS_RA_MAX; any other read closes it again. While the window
+ * is open we keep the blocks up to one window past the reader's
+ * position queued for reading.
+ *
+ * The reads themselves are done by a kernel thread, which pulls
+ * requests (runs of consecutive disk blocks) off a small queue and
+ * brings them into the buffer cache with sfs_bread_cluster. The
+ * reader is back in userland consuming what it got while the disk
+ * works on what it will want next.
+ *
+ * Read-ahead is only a hint: if the queue is full a request is
+ * dropped, and blocks freed or reallocated in the meantime are safe
+ * because every allocation overwrites or zeroes its buffer.
+ *
+ * Locking: sfs_ralock protects the queue and sfs_racurrent, and is
+ * never held during I/O. The thread reads through the buffer cache
+ * without any vnode lock, which is fine as read-ahead never changes
+ * anything a file can see. sfs_ra_purge, called at unmount, cancels
+ * whatever is pending for the volume and waits on sfs_radonecv for a
+ * request already in progress to finish.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <vfs.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Window size limits, in blocks */
+#define SFS_RA_MIN	4
+#define SFS_RA_MAX	32
+
+/* Pending requests */
+#define SFS_RA_QUEUE	16
+
+struct sfs_rareq {
+	struct sfs_fs *rr_fs;		/* Volume, or NULL if cancelled */
+	daddr_t rr_block;		/* First disk block */
+	unsigned rr_nblocks;		/* Length of run */
+};
+
+static struct lock *sfs_ralock;
+static struct cv *sfs_racv;
+static struct cv *sfs_radonecv;
+static struct sfs_rareq sfs_raqueue[SFS_RA_QUEUE];
+static unsigned sfs_rahead, sfs_racount;
+static struct sfs_rareq sfs_racurrent;
+
+/*
+ * The read-ahead thread.
+ */
+static
+void
+sfs_ra_thread(void *data1, unsigned long data2)
+{
+	struct sfs_rareq req;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		lock_acquire(sfs_ralock);
+		while (sfs_racount == 0) {
+			cv_wait(sfs_racv, sfs_ralock);
+		}
+		sfs_racurrent = sfs_raqueue[sfs_rahead];
+		sfs_rahead = (sfs_rahead + 1) % SFS_RA_QUEUE;
+		sfs_racount--;
+		req = sfs_racurrent;
+		lock_release(sfs_ralock);
+
+		if (req.rr_fs != NULL) {
+			/* Errors will be seen again by the real read */
+			(void)sfs_bread_cluster(req.rr_fs, req.rr_block,
+						req.rr_nblocks);
+		}
+
+		lock_acquire(sfs_ralock);
+		sfs_racurrent.rr_fs = NULL;
+		cv_broadcast(sfs_radonecv, sfs_ralock);
+		lock_release(sfs_ralock);
+	}
+}
+
+/*
+ * Create the queue and start the thread. Called from mount, which is
+ * serialized.
+ */
+int
+sfs_ra_bootstrap(void)
+{
+	int result;
+
+	if (sfs_ralock != NULL) {
+		return 0;
+	}
+	sfs_racv = cv_create("sfs_ra");
+	if (sfs_racv == NULL) {
+		return ENOMEM;
+	}
+	sfs_radonecv = cv_create("sfs_radone");
+	if (sfs_radonecv == NULL) {
+		cv_destroy(sfs_racv);
+		sfs_racv = NULL;
+		return ENOMEM;
+	}
+	sfs_ralock = lock_create("sfs_ra");
+	if (sfs_ralock == NULL) {
+		cv_destroy(sfs_radonecv);
+		cv_destroy(sfs_racv);
+		sfs_radonecv = NULL;
+		sfs_racv = NULL;
+		return ENOMEM;
+	}
+	result = thread_fork("sfs_readahead", NULL, sfs_ra_thread, NULL, 0);
+	if (result) {
+		lock_destroy(sfs_ralock);
+		cv_destroy(sfs_radonecv);
+		cv_destroy(sfs_racv);
+		sfs_ralock = NULL;
+		sfs_radonecv = NULL;
+		sfs_racv = NULL;
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * Queue a run of disk blocks for reading, unless the queue is full.
+ */
+static
+void
+sfs_ra_queue(struct sfs_fs *sfs, daddr_t block, unsigned nblocks)
+{
+	struct sfs_rareq *req;
+
+	lock_acquire(sfs_ralock);
+	if (sfs_racount < SFS_RA_QUEUE) {
+		req = &sfs_raqueue[(sfs_rahead + sfs_racount) % SFS_RA_QUEUE];
+		req->rr_fs = sfs;
+		req->rr_block = block;
+		req->rr_nblocks = nblocks;
+		sfs_racount++;
+		cv_signal(sfs_racv, sfs_ralock);
+	}
+	lock_release(sfs_ralock);
+}
+
+/*
+ * Cancel all read-ahead for a volume that is being unmounted, and
+ * wait out any that has already started.
+ */
+void
+sfs_ra_purge(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	if (sfs_ralock == NULL) {
+		return;
+	}
+	lock_acquire(sfs_ralock);
+	for (i=0; i<sfs_racount; i++) {
+		if (sfs_raqueue[(sfs_rahead + i) % SFS_RA_QUEUE].rr_fs == sfs) {
+			sfs_raqueue[(sfs_rahead + i) % SFS_RA_QUEUE].rr_fs =
+				NULL;
+		}
+	}
+	while (sfs_racurrent.rr_fs == sfs) {
+		cv_wait(sfs_radonecv, sfs_ralock);
+	}
+	lock_release(sfs_ralock);
+}
+
+/*
+ * Called after a read of SV covering bytes [START, END). Update the
+ * sequential-access state and queue read-ahead if the reader is
+ * getting close to the end of what we've already asked for.
+ */
+void
+sfs_readahead(struct sfs_vnode *sv, off_t start, off_t end)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t curblock, target, fileblock, filelen;
+	daddr_t first, next;
+	unsigned len;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (start != sv->sv_ranext || start == end) {
+		/* Not sequential (or nothing read); close the window */
+		sv->sv_ranext = end;
+		sv->sv_rawindow = 0;
+		sv->sv_rablock = 0;
+		return;
+	}
+	sv->sv_ranext = end;
+
+	if (sv->sv_rawindow == 0) {
+		sv->sv_rawindow = SFS_RA_MIN;
+	}
+	else if (sv->sv_rawindow < SFS_RA_MAX) {
+		sv->sv_rawindow *= 2;
+	}
+
+	curblock = DIVROUNDUP(end, SFS_BLOCKSIZE);
+	if (sv->sv_rablock < curblock) {
+		sv->sv_rablock = curblock;
+	}
+
+	/* Wait until at least half the window has been consumed */
+	if (sv->sv_rablock - curblock > sv->sv_rawindow / 2) {
+		return;
+	}
+
+	filelen = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	target = curblock + sv->sv_rawindow;
+	if (target > filelen) {
+		target = filelen;
+	}
+
+	/* Queue each run of consecutive disk blocks in [rablock, target) */
+	fileblock = sv->sv_rablock;
+	while (fileblock < target) {
+		result = sfs_bmap(sv, fileblock, false, &first);
+		if (result) {
+			break;
+		}
+		len = 1;
+		if (first != 0) {
+			while (fileblock + len < target) {
+				result = sfs_bmap(sv, fileblock + len, false,
+						  &next);
+				if (result || next != first + len) {
+					break;
+				}
+				len++;
+			}
+			sfs_ra_queue(sfs, first, len);
+		}
+		fileblock += len;
+	}
+	sv->sv_rablock = fileblock;
+}
@@ -0,0 +1,206 @@
+/*
+ * SFS filesystem
+ *
+ * Syncer.
+ *
+ * A kernel thread that syncs every mounted SFS volume each
+ * SFS_SYNC_INTERVAL seconds, so changes reach disk without waiting
+ * for an explicit sync or unmount. Since sfs_sync writes only what
+ * has changed, a pass over an idle volume costs next to nothing.
+ *
+ * A writer that runs out of space while freed blocks are still held
+ * back waiting for a sync can have a pass run at once with
+ * sfs_syncer_kick.
+ *
+ * Locking: sfs_syncerlock protects the list of volumes, and is held
+ * while the thread syncs them, so once sfs_syncer_remove returns the
+ * thread is done with the volume. Mount and unmount add and remove
+ * volumes with vfs_biglock held, so sfs_syncerlock comes after it;
+ * the thread itself never takes vfs_biglock. sfs_syncerspin covers
+ * the thread's sleep and the pass counts; the wake-up timer takes it
+ * from interrupt context.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <synch.h>
+#include <thread.h>
+#include <fs.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Seconds between passes */
+#define SFS_SYNC_INTERVAL	5
+
+static struct lock *sfs_syncerlock;
+static struct sfs_fs *sfs_syncerlist;
+
+static struct spinlock sfs_syncerspin = SPINLOCK_INITIALIZER;
+static struct wchan *sfs_syncerwchan;
+static struct timer sfs_syncertimer;
+static bool sfs_syncerarmed;		/* sfs_syncertimer is pending */
+static bool sfs_syncerdue;		/* time for a pass */
+static unsigned sfs_syncerstarted;	/* passes begun */
+static unsigned sfs_syncerdone;		/* passes finished */
+
+/*
+ * Timer function: the interval is up.
+ */
+static
+void
+sfs_syncer_alarm(void *data)
+{
+	(void)data;
+
+	spinlock_acquire(&sfs_syncerspin);
+	sfs_syncerarmed = false;
+	sfs_syncerdue = true;
+	wchan_wakeall(sfs_syncerwchan, &sfs_syncerspin);
+	spinlock_release(&sfs_syncerspin);
+}
+
+/*
+ * The syncer thread.
+ *
+ * When kicked early the timer is left running, and its expiry just
+ * causes one more (cheap) pass. Stopping and rearming it instead
+ * could race with timerclock, which may already have taken it off
+ * the wheel to call sfs_syncer_alarm.
+ */
+static
+void
+sfs_syncer_thread(void *data1, unsigned long data2)
+{
+	struct sfs_fs *sfs;
+	struct timespec when;
+	int result;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		spinlock_acquire(&sfs_syncerspin);
+		if (!sfs_syncerarmed) {
+			gettime(&when);
+			when.tv_sec += SFS_SYNC_INTERVAL;
+			sfs_syncerarmed = true;
+			timer_start(&sfs_syncertimer, &when);
+		}
+		while (!sfs_syncerdue) {
+			wchan_sleep(sfs_syncerwchan, &sfs_syncerspin);
+		}
+		sfs_syncerdue = false;
+		sfs_syncerstarted++;
+		spinlock_release(&sfs_syncerspin);
+
+		lock_acquire(sfs_syncerlock);
+		for (sfs = sfs_syncerlist; sfs != NULL;
+		     sfs = sfs->sfs_syncnext) {
+			result = FSOP_SYNC(&sfs->sfs_absfs);
+			if (result) {
+				/* Whatever didn't get written is still dirty */
+				kprintf("sfs: %s: sync: %s\n",
+					sfs->sfs_sb.sb_volname,
+					strerror(result));
+			}
+		}
+		lock_release(sfs_syncerlock);
+
+		spinlock_acquire(&sfs_syncerspin);
+		sfs_syncerdone = sfs_syncerstarted;
+		wchan_wakeall(sfs_syncerwchan, &sfs_syncerspin);
+		spinlock_release(&sfs_syncerspin);
+	}
+}
+
+/*
+ * Create the list lock and start the thread. Called from mount,
+ * which is serialized.
+ */
+int
+sfs_syncer_bootstrap(void)
+{
+	int result;
+
+	if (sfs_syncerlock != NULL) {
+		return 0;
+	}
+	sfs_syncerlock = lock_create("sfs_syncer");
+	if (sfs_syncerlock == NULL) {
+		return ENOMEM;
+	}
+	sfs_syncerwchan = wchan_create("sfs_syncer");
+	if (sfs_syncerwchan == NULL) {
+		lock_destroy(sfs_syncerlock);
+		sfs_syncerlock = NULL;
+		return ENOMEM;
+	}
+	timer_init(&sfs_syncertimer, sfs_syncer_alarm, NULL);
+	result = thread_fork("sfs_syncer", NULL, sfs_syncer_thread, NULL, 0);
+	if (result) {
+		wchan_destroy(sfs_syncerwchan);
+		sfs_syncerwchan = NULL;
+		lock_destroy(sfs_syncerlock);
+		sfs_syncerlock = NULL;
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * Have the syncer make a pass now, and wait until it has finished
+ * one that began after we were called; a pass already under way may
+ * have collected the pending frees before ours were made.
+ *
+ * The pass takes the vnode lock of every loaded file, so the caller
+ * must hold no SFS locks at all.
+ */
+void
+sfs_syncer_kick(void)
+{
+	unsigned target;
+
+	spinlock_acquire(&sfs_syncerspin);
+	target = sfs_syncerstarted + 1;
+	sfs_syncerdue = true;
+	wchan_wakeall(sfs_syncerwchan, &sfs_syncerspin);
+	while ((int)(sfs_syncerdone - target) < 0) {
+		wchan_sleep(sfs_syncerwchan, &sfs_syncerspin);
+	}
+	spinlock_release(&sfs_syncerspin);
+}
+
+/*
+ * Start syncing a newly mounted volume.
+ */
+void
+sfs_syncer_add(struct sfs_fs *sfs)
+{
+	lock_acquire(sfs_syncerlock);
+	sfs->sfs_syncnext = sfs_syncerlist;
+	sfs_syncerlist = sfs;
+	lock_release(sfs_syncerlock);
+}
+
+/*
+ * Stop syncing a volume that is being unmounted, waiting out a pass
+ * that is already in progress.
+ */
+void
+sfs_syncer_remove(struct sfs_fs *sfs)
+{
+	struct sfs_fs **pp;
+
+	lock_acquire(sfs_syncerlock);
+	for (pp = &sfs_syncerlist; *pp != NULL; pp = &(*pp)->sfs_syncnext) {
+		if (*pp == sfs) {
+			*pp = sfs->sfs_syncnext;
+			break;
+		}
+	}
+	sfs->sfs_syncnext = NULL;
+	lock_release(sfs_syncerlock);
+}
@@ -37,22 +37,52 @@
 extern const struct vnode_ops sfs_fileops;
 extern const struct vnode_ops sfs_dirops;
 
+/* Buckets in each volume's table of loaded vnodes, keyed by inode */
+#define SFS_VNHASH_SIZE 128
+#define SFS_VNHASH(ino) ((ino) % SFS_VNHASH_SIZE)
+
+/* Most blocks moved in one device request by the buffer cache */
+#define SFS_BUF_CLUSTER 16
+
 /* Macro for initializing a uio structure */
 #define SFSUIO(iov, uio, ptr, block, rw) \
     uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
 
 
 /* Functions in sfs_balloc.c */
-int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
+int sfs_balloc(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock);
+int sfs_balloc_file(struct sfs_vnode *sv, bool zero, daddr_t *diskblock);
+void sfs_prealloc_release(struct sfs_vnode *sv);
+bool sfs_buninit(struct sfs_fs *sfs, daddr_t diskblock);
+void sfs_binit(struct sfs_fs *sfs, daddr_t diskblock);
+int sfs_binit_all(struct sfs_fs *sfs);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
+void sfs_bfree_collect(struct sfs_fs *sfs);
+void sfs_bfree_commit(struct sfs_fs *sfs);
+bool sfs_bpending(struct sfs_fs *sfs);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 
+/* Functions in sfs_buf.c */
+struct sfs_buf;
+int sfs_buf_bootstrap(void);
+int sfs_bread(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret);
+int sfs_bget(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret);
+int sfs_bread_cluster(struct sfs_fs *sfs, daddr_t block, unsigned nblocks);
+void sfs_brelse(struct sfs_buf *buf);
+void *sfs_bdata(struct sfs_buf *buf);
+bool sfs_bvalid(struct sfs_buf *buf);
+void sfs_bdirty(struct sfs_buf *buf);
+void sfs_binval(struct sfs_fs *sfs, daddr_t block);
+int sfs_bsync(struct sfs_fs *sfs);
+void sfs_bpurge(struct sfs_fs *sfs);
+
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		daddr_t *diskblock);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
 
 /* Functions in sfs_dir.c */
+void sfs_dirhash_destroy(struct sfs_vnode *sv);
 int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		uint32_t *ino, int *slot, int *emptyslot);
 int sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino,
@@ -62,6 +92,9 @@ int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
+/* Functions in sfs_fsops.c */
+int sfs_sync_freemap(struct sfs_fs *sfs);
+
 /* Functions in sfs_inode.c */
 int sfs_sync_inode(struct sfs_vnode *sv);
 int sfs_reclaim(struct vnode *v);
@@ -71,11 +104,23 @@ int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
 
 /* Functions in sfs_io.c */
+int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
 int sfs_metaio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
 	       enum uio_rw rw);
 
+/* Functions in sfs_readahead.c */
+int sfs_ra_bootstrap(void);
+void sfs_ra_purge(struct sfs_fs *sfs);
+void sfs_readahead(struct sfs_vnode *sv, off_t start, off_t end);
+
+/* Functions in sfs_syncer.c */
+int sfs_syncer_bootstrap(void);
+void sfs_syncer_add(struct sfs_fs *sfs);
+void sfs_syncer_remove(struct sfs_fs *sfs);
+void sfs_syncer_kick(void);
+
 
 #endif /* _SFSPRIVATE_H_ */
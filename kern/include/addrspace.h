@@ -71,8 +71,9 @@ struct addrspace
         void **pt_l1;
         unsigned pt_l1_entries;
 
-        /* lock per proteggere PT L1/L2 */
-        struct lock *pt_lock;
+        /* lock per proteggere PT L1/L2: lettura per i lookup (reload
+         * TLB), scrittura per pubblicare L2 e modificare le PTE */
+        struct rwlock *pt_lock;
 };
 
 #elif OPT_DUMBVM
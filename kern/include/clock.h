@@ -38,8 +38,9 @@
 
 
 /*
- * hardclock() is called on every CPU HZ times a second, possibly only
- * when the CPU is not idle, for scheduling.
+ * hardclock() is called on every CPU HZ times a second, for
+ * scheduling. CPUs that are idle stop their hardclock when they can
+ * (see clock_tickless_ok) and don't get it at all until they unidle.
  */
 
 /* hardclocks per second */
@@ -49,10 +50,42 @@ void hardclock_bootstrap(void);
 void hardclock(void);
 
 /*
- * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * Timers. A timer calls tm_func(tm_data) once, in interrupt context,
+ * when the time it was started for has passed. The structure may be
+ * embedded anywhere (e.g. on the stack) as long as it stays around
+ * until it has either expired or been stopped.
+ *
+ * timer_init sets up a timer; timer_start arms it for the absolute
+ * time WHEN (as returned by gettime); timer_stop disarms it and
+ * returns true if it had not expired yet.
+ */
+struct timer {
+	struct timer *tm_next;		/* Wheel slot list */
+	struct timer **tm_pprev;	/* Back link; NULL if not pending */
+	uint64_t tm_expires;		/* Expiry time, in usecs */
+	unsigned tm_level;		/* Wheel level it is filed in */
+	void (*tm_func)(void *);	/* Called at expiry */
+	void *tm_data;			/* Argument for tm_func */
+};
+
+void timer_init(struct timer *tm, void (*func)(void *), void *data);
+void timer_start(struct timer *tm, const struct timespec *when);
+bool timer_stop(struct timer *tm);
+
+/*
+ * timerclock() runs expired timers. It is called on one CPU by the
+ * one-shot event timer registered with clock_register_oneshot, whose
+ * SET function must arrange for one call of timerclock() USECS
+ * microseconds later. Without such a device, CPU 0's hardclock
+ * calls timerclock() instead and timers get HZ resolution.
  */
 void timerclock(void);
+void clock_register_oneshot(void *devdata, void (*set)(void *, uint32_t));
+
+/*
+ * Returns true if idle CPUs may switch their hardclock off.
+ */
+bool clock_tickless_ok(void);
 
 /*
  * gettime() may be used to fetch the current time of day.
@@ -76,8 +109,11 @@ void timespec_sub(const struct timespec *t1,
 /*
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
+ * clocknanosleep() does the same for an arbitrary duration, like
+ * nanosleep(2).
  */
 void clocksleep(int seconds);
+void clocknanosleep(const struct timespec *duration);
 
 
 #endif /* _CLOCK_H_ */
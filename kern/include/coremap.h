@@ -9,6 +9,7 @@
 /* Inizializzazione e stato */
 void coremap_bootstrap(void);
 int  coremap_is_ready(void);
+void coremap_getstats(unsigned long *nframes, unsigned long *nfree);
 
 /* Allocazione / liberazione di frame fisici (contigui) */
 paddr_t coremap_alloc_page(void);
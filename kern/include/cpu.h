@@ -33,6 +33,7 @@
 
 #include <spinlock.h>
 #include <threadlist.h>
+#include <thread.h>      /* for SCHED_NLEVELS */
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
@@ -59,15 +60,24 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_deadthreads; /* Cleaned up, for reuse; with
+					   stacks. Touched only at splhigh */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	bool c_tickless;		/* Idle with hardclock off (other
+					   cpus may peek at it unlocked) */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
+	 *
+	 * The run queue is split into SCHED_NLEVELS lists, one per
+	 * priority level of the multilevel feedback queue; level 0 is
+	 * the highest priority. See schedule() in thread.c.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NLEVELS]; /* Run queues */
+	unsigned c_migrations;		/* Threads stolen by this cpu */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -117,6 +127,12 @@ void cpu_hatch(unsigned software_number);
  */
 void cpu_identify(char *buf, size_t max);
 
+/*
+ * Print per-cpu scheduler statistics (hardclocks, run queue length,
+ * thread migrations).
+ */
+void cpu_printstats(void);
+
 /*
  * Hardware-level interrupt on/off, for the current CPU.
  *
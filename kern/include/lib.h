@@ -126,6 +126,7 @@ uint32_t random(void);
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
  */
+void kheap_bootstrap(void);
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
@@ -162,6 +163,7 @@ const char *strerror(int errcode);
  * Low-level console access.
  */
 void putch(int ch);
+void putbuf(const char *buf, size_t len);
 int getch(void);
 void beep(void);
 
@@ -177,7 +179,11 @@ void beep(void);
  * kprintf_bootstrap sets up a lock for kprintf and should be called
  * during boot once malloc is available and before any additional
  * threads are created.
+ *
+ * panicking is set once panic has been called, for code that must
+ * not wait for locks other CPUs may be holding.
  */
+extern volatile bool panicking;
 int kprintf(const char *format, ...) __PF(1,2);
 __DEAD void panic(const char *format, ...) __PF(1,2);
 __DEAD void badassert(const char *expr, const char *file,
@@ -52,6 +52,12 @@ void mainbus_interrupt(struct trapframe *);
 /* XXX this interface is not adequately MI */
 size_t mainbus_ramsize(void);
 
+/*
+ * Switch the periodic hardclock of the current cpu off (while idle)
+ * or back on.
+ */
+void mainbus_set_hardclock(bool enable);
+
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
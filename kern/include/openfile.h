@@ -0,0 +1,66 @@
+#ifndef _OPENFILE_H_
+#define _OPENFILE_H_
+
+/*
+ * Open files and per-process file descriptor tables.
+ *
+ * An openfile is what a file descriptor refers to: the vnode plus
+ * the state that open() creates, i.e. the seek position and the
+ * access mode. Several descriptors (dup2) and several processes
+ * (fork) may share one openfile, and with it the seek position, so
+ * openfiles are refcounted.
+ *
+ * The descriptor table itself lives in struct proc (p_filetable).
+ * User processes are single-threaded, so only the owning thread
+ * touches it and it needs no lock.
+ */
+
+#include "opt-file.h"
+
+#if OPT_FILE
+#include <spinlock.h>
+
+struct vnode;
+struct proc;
+
+struct openfile {
+	struct vnode *of_vnode;
+	int of_accmode;			/* O_RDONLY, O_WRONLY or O_RDWR */
+	bool of_append;			/* O_APPEND: writes go to EOF */
+	off_t of_offset;		/* seek position, under of_lock */
+	struct lock *of_lock;
+	unsigned of_refcount;		/* under of_reflock */
+	struct spinlock of_reflock;
+};
+
+/*
+ * openfile_open  - vfs_open PATH (which may be clobbered) and wrap it.
+ * openfile_incref/decref - add/drop a reference; the last decref
+ *                  closes the vnode.
+ */
+int openfile_open(char *path, int flags, mode_t mode, struct openfile **ret);
+void openfile_incref(struct openfile *of);
+void openfile_decref(struct openfile *of);
+
+/*
+ * Descriptor table operations on a process:
+ *
+ * filetable_init     - empty table.
+ * filetable_openstd  - open the console as fds 0, 1 and 2.
+ * filetable_copy     - make DST's table share all of SRC's openfiles
+ *                      (for fork). DST's table must be empty.
+ * filetable_closeall - drop every descriptor.
+ * filetable_get      - look up FD; EBADF if not open.
+ * filetable_place    - put OF in the lowest free slot; EMFILE if full.
+ *                      Consumes the caller's reference on success.
+ */
+void filetable_init(struct proc *p);
+int filetable_openstd(struct proc *p);
+void filetable_copy(struct proc *src, struct proc *dst);
+void filetable_closeall(struct proc *p);
+int filetable_get(struct proc *p, int fd, struct openfile **ret);
+int filetable_place(struct proc *p, struct openfile *of, int *fd);
+
+#endif /* OPT_FILE */
+
+#endif /* _OPENFILE_H_ */
@@ -38,10 +38,13 @@
 
 #include <spinlock.h>
 #include "opt-waitpid.h"
+#include "opt-file.h"
+#include <limits.h>
 
 struct addrspace;
 struct thread;
 struct vnode;
+struct openfile;
 
 /*
  * Process structure.
@@ -77,12 +80,16 @@ struct proc {
 
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
+#if OPT_FILE
+	struct openfile *p_filetable[OPEN_MAX]; /* see openfile.h */
+#endif
 
 	/* add more material here as needed */
 #if OPT_WAITPID
         /* G.Cabodi - 2019 - implement waitpid: synchro, and exit status */
         int p_status;                   /* status as obtained by exit() */
         pid_t p_pid;                    /* process pid */
+        struct proc *p_hashnext;        /* pid hash chain */
 #if USE_SEMAPHORE_FOR_WAITPID
 	struct semaphore *p_sem;
 #else
@@ -101,6 +108,9 @@ void proc_bootstrap(void);
 /* Create a fresh process for use by runprogram(). */
 struct proc *proc_create_runprogram(const char *name);
 
+/* Likewise, returning an error code (ENOMEM or ENPROC) on failure. */
+int proc_create_child(const char *name, struct proc **ret);
+
 /* Destroy a process. */
 void proc_destroy(struct proc *proc);
 
@@ -39,7 +39,7 @@ struct pte
 
 int pt_init(struct addrspace *as);                              /* L1 lazy */
 void pt_destroy(struct addrspace *as);                          /* free L2 + L1 */
-struct pte *pt_lookup(struct addrspace *as, vaddr_t va);        /* NULL se L2 assente */
+struct pte *pt_lookup(struct addrspace *as, vaddr_t va);        /* NULL se L2 assente; chiamante tiene pt_lock (R o W) */
 struct pte *pt_lookup_create(struct addrspace *as, vaddr_t va); /* crea L2 se serve */
 
 #endif /* OPT_PAGING */
@@ -48,14 +48,71 @@
  */
 #include <kern/sfs.h>
 
+/*
+ * Locking.
+ *
+ * Each vnode has a lock, sv_lock, covering everything in struct
+ * sfs_vnode below sv_absvn except sv_ino (constant), sv_reclaiming
+ * and sv_hashnext (under sfs_vnlock), and the preallocation window
+ * (under sfs_freemaplock). sfs_vnlock covers the table of loaded
+ * vnodes; sfs_freemaplock covers the freemap, the other block maps,
+ * and the list of files with preallocated blocks. sfs_synclock is held for the whole of a sync, and
+ * sfs_freelock (an rwlock) orders frees against it, as explained in
+ * sfs_fsops.c. sfs_fmiolock serializes writes of the freemap, which
+ * go straight to disk rather than through the buffer cache, so any
+ * buffer can wait for them before being written back. The superblock and the volume name don't change once
+ * mounted. The buffer cache (sfs_buf.c), read-ahead queue
+ * (sfs_readahead.c) and syncer (sfs_syncer.c) have locks of their
+ * own.
+ *
+ * Locks are taken in this order:
+ *
+ *    1. vfs_biglock (mount, unmount, global sync)
+ *    2. sfs_syncerlock
+ *    3. sfs_synclock
+ *    4. directory sv_lock, then the sv_lock of a file in it
+ *    5. sfs_freelock
+ *    6. sfs_vnlock
+ *    7. buffers, held busy (more than one only as described in
+ *       sfs_buf.c)
+ *    8. sfs_fmiolock
+ *    9. sfs_freemaplock, sfs_ralock, sfs_buflock
+ *
+ * sfs_freemaplock and sfs_ralock are leaves: nothing else is
+ * acquired, and no I/O is done, while holding them. No page fault
+ * can happen with an SFS lock held, since user data is copied
+ * through a kernel buffer with no locks held (sfs_vnops.c). But
+ * memory allocated under them (for buffers) may be found by evicting
+ * a page to swap, so the swap file's sv_lock comes after every
+ * other. With "options hangman" every lock (but not sfs_freelock,
+ * which is an rwlock) reports to the deadlock detector, which panics
+ * on a cycle.
+ */
+
 /*
  * In-memory inode
  */
+struct sfs_dirhash;	/* Opaque; in sfs_dir.c */
+
 struct sfs_vnode {
 	struct vnode sv_absvn;          /* abstract vnode structure */
+	struct lock *sv_lock;           /* protects the rest */
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	daddr_t sv_goal;                /* where to allocate next block */
+	daddr_t sv_pastart;             /* start of preallocation window */
+	unsigned sv_palen;              /* blocks left in window */
+	struct sfs_vnode *sv_panext;    /* in sfs_palist, if sv_palen > 0 */
+	uint32_t sv_extfile;            /* cached run: first file block */
+	daddr_t sv_extdisk;             /* cached run: first disk block */
+	uint32_t sv_extlen;             /* cached run: length (0 = none) */
+	off_t sv_ranext;                /* where a sequential read starts */
+	unsigned sv_rawindow;           /* read-ahead window (blocks) */
+	uint32_t sv_rablock;            /* read-ahead queued up to here */
+	struct sfs_dirhash *sv_dirhash; /* name hash, for directories */
+	bool sv_reclaiming;             /* being torn down; don't use */
+	struct sfs_vnode *sv_hashnext;  /* chain in sfs_vnhash */
 };
 
 /*
@@ -66,9 +123,24 @@ struct sfs_fs {
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct lock *sfs_vnlock;        /* protects sfs_vnhash */
+	struct cv *sfs_vncv;            /* a reclaim finished */
+	struct sfs_vnode **sfs_vnhash;  /* vnodes loaded into memory */
+	unsigned sfs_nvnodes;           /* # of vnodes in sfs_vnhash */
+	struct lock *sfs_synclock;      /* held while syncing */
+	struct rwlock *sfs_freelock;    /* read to free, write to collect */
+	struct lock *sfs_fmiolock;      /* held while writing the freemap */
+	char *sfs_fmbuf;                /* freemap block being written */
+	struct lock *sfs_freemaplock;   /* protects the maps below */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
-	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct bitmap *sfs_fmdirty;     /* freemap blocks modified */
+	unsigned sfs_nfmdirty;          /* # of bits set in sfs_fmdirty */
+	struct bitmap *sfs_freed;       /* freed since the last collect */
+	struct bitmap *sfs_freeing;     /* collected; sync will release */
+	struct bitmap *sfs_uninitmap;   /* allocated but never written */
+	unsigned sfs_nuninit;           /* # of bits set in sfs_uninitmap */
+	struct sfs_vnode *sfs_palist;   /* files with preallocated blocks */
+	struct sfs_fs *sfs_syncnext;    /* syncer's list of volumes */
 };
 
 /*
@@ -76,5 +148,10 @@ struct sfs_fs {
  */
 int sfs_mount(const char *device);
 
+/*
+ * Print buffer cache statistics
+ */
+void sfs_bufstats(void);
+
 
 #endif /* _SFS_H_ */
@@ -37,6 +37,7 @@
 
 #include <cdefs.h>
 #include <hangman.h>
+#include "opt-lockstat.h"
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -51,24 +52,46 @@
  *
  * Note that spinlocks are held by CPUs, not by threads.
  *
+ * This is a ticket lock: each acquirer atomically takes the next
+ * ticket and then spins until the lock is serving its number. CPUs
+ * thus get the lock in the order they asked for it, and a release is
+ * a single plain store instead of every waiter retrying an atomic
+ * operation on the same word at once.
+ *
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
  */
 struct spinlock {
-	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
+	volatile spinlock_data_t splk_next; /* Next ticket to hand out. */
+	volatile spinlock_data_t splk_serving; /* Ticket served; spin here. */
 	struct cpu *splk_holder;	    /* CPU holding this lock. */
 	HANGMAN_LOCKABLE(splk_hangman);     /* Deadlock detector hook. */
+#if OPT_LOCKSTAT
+	/* Statistics, updated by the holder. */
+	uint64_t splk_acquires;		    /* Times acquired. */
+	uint64_t splk_contended;	    /* ...not on the first try. */
+	uint64_t splk_spins;		    /* Total spin-loop iterations. */
+#endif
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
-#ifdef OPT_HANGMAN
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, \
-				  HANGMAN_LOCKABLE_INITIALIZER }
+#if OPT_LOCKSTAT
+#define SPINLOCK_STATS_INITIALIZER	, 0, 0, 0
+#else
+#define SPINLOCK_STATS_INITIALIZER
+#endif
+#if OPT_HANGMAN
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, \
+				  SPINLOCK_DATA_INITIALIZER, NULL, \
+				  HANGMAN_LOCKABLE_INITIALIZER \
+				  SPINLOCK_STATS_INITIALIZER }
 #else
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, \
+				  SPINLOCK_DATA_INITIALIZER, NULL \
+				  SPINLOCK_STATS_INITIALIZER }
 #endif
 
 /*
@@ -91,5 +114,15 @@ void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+/*
+ * Statistics (options lockstat).
+ *
+ * watch	Give a (long-lived) spinlock a name and have its counters
+ *		reported by printstats. Does nothing without the option.
+ * printstats	Print the counters of all watched spinlocks.
+ */
+void spinlock_watch(struct spinlock *lk, const char *name);
+void spinlock_printstats(void);
+
 
 #endif /* _SPINLOCK_H_ */
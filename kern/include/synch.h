@@ -42,10 +42,14 @@
 /* G.Cabodi - 2019 - implementing locks and CVs */
 /* option "synch" needed in conf.kern (and enabled!) */
 #include "opt-synch.h" 
+#include "opt-lockstat.h"
 /* 1: implement lock as a binary semaphore (+ pointer to thread) 
- * 0: lock implemented by wait channel
+ * 0: lock implemented by wait channel (adaptive: spins while the
+ *    owner is running on another cpu, then sleeps)
  */
-#define USE_SEMAPHORE_FOR_LOCK 1
+#define USE_SEMAPHORE_FOR_LOCK 0
+/* max iterations spent spinning on a running owner before sleeping */
+#define LOCK_SPIN_MAX 2000
 /* ------------------------------------------------------------- */
 
 /*
@@ -95,6 +99,10 @@ struct lock {
 #endif
 	struct spinlock lk_lock;
         volatile struct thread *lk_owner;
+	HANGMAN_LOCKABLE(lk_hangman);	/* Deadlock detector hook */
+#endif
+#if OPT_LOCKSTAT
+	struct lockstat *lk_stats;	/* shared by all locks of this name */
 #endif
 };
 
@@ -116,6 +124,16 @@ void lock_acquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 
+/*
+ * Lock contention statistics (options lockstat). Counters are kept
+ * per lock name, summed over every lock created with that name:
+ * acquisitions, acquisitions that found the lock held, how many of
+ * those got it by spinning, and how many had to sleep.
+ *
+ * lockstat_print dumps them; without the option it does nothing.
+ */
+void lockstat_print(void);
+
 
 /*
  * Condition variable.
@@ -162,4 +180,62 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or a single
+ * writer. The lock is writer-preferring: once a writer is waiting,
+ * new readers block, so a steady stream of readers cannot starve
+ * writers (the converse is possible and accepted). Read locks are
+ * therefore not recursive: a thread holding a read lock must not
+ * acquire it again for reading.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct rwlock {
+        char *rwlock_name;
+	struct spinlock rw_lock;
+	struct wchan *rw_rwchan;	/* readers wait here */
+	struct wchan *rw_wwchan;	/* writers wait here */
+	struct wchan *rw_uwchan;	/* the upgrading reader waits here */
+	unsigned rw_readers;		/* # of read holders */
+	unsigned rw_waitwriters;	/* # of writers sleeping */
+	struct thread *rw_writer;	/* write holder, if any */
+	struct thread *rw_upgrader;	/* reader trying to upgrade */
+};
+
+struct rwlock *rwlock_create(const char *);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading. Multiple threads
+ *                           can hold the lock for reading at the same time.
+ *    rwlock_release_read  - Free the lock.
+ *    rwlock_acquire_write - Get the lock for writing. Only one thread can
+ *                           hold the write lock at one time.
+ *    rwlock_release_write - Free the write lock.
+ *    rwlock_tryupgrade    - Turn a read hold into a write hold without
+ *                           letting go in between. Fails (returning
+ *                           false, still holding the read lock) if some
+ *                           other reader is already upgrading, as both
+ *                           would otherwise wait for each other forever.
+ *                           The caller must then drop the read lock and
+ *                           take the write lock, and revalidate.
+ *    rwlock_downgrade     - Turn a write hold into a read hold.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                           the write lock.
+ *
+ * These operations must be atomic.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_tryupgrade(struct rwlock *);
+void rwlock_downgrade(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
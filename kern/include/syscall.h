@@ -34,6 +34,7 @@
 #include <cdefs.h> /* for __DEAD */
 #include "opt-syscall.h"
 #include "opt-fork.h"
+#include "opt-file.h"
 
 struct trapframe; /* from <machine/trapframe.h> */
 
@@ -61,12 +62,23 @@ __DEAD void enter_new_process(int argc, userptr_t argv, userptr_t env,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(userptr_t user_req, userptr_t user_remainder);
 #if OPT_SYSCALL
+#if OPT_FILE
+int sys_open(userptr_t upath, int flags, mode_t mode, int *retval);
+int sys_close(int fd);
+int sys_write(int fd, userptr_t buf_ptr, size_t size, int *retval);
+int sys_read(int fd, userptr_t buf_ptr, size_t size, int *retval);
+int sys_lseek(int fd, off_t pos, int whence, off_t *retval);
+int sys_dup2(int oldfd, int newfd, int *retval);
+#else
 int sys_write(int fd, userptr_t buf_ptr, size_t size);
 int sys_read(int fd, userptr_t buf_ptr, size_t size);
+#endif
 void sys__exit(int status);
 int sys_waitpid(pid_t pid, userptr_t statusp, int options);
 pid_t sys_getpid(void);
+int sys_execv(userptr_t uprogname, userptr_t uargv);
 #if OPT_FORK
 int sys_fork(struct trapframe *ctf, pid_t *retval);
 #endif
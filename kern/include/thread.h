@@ -56,6 +56,12 @@ struct cpu;
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
 
+/*
+ * Number of priority levels of the multilevel feedback queue
+ * scheduler. Level 0 is the highest priority.
+ */
+#define SCHED_NLEVELS 4
+
 /* States a thread can be in. */
 typedef enum {
 	S_RUN,		/* running */
@@ -85,6 +91,16 @@ struct thread {
 	struct proc *t_proc;		/* Process thread belongs to */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
 
+	/*
+	 * Scheduler fields. Protected by the runqueue lock of t_cpu
+	 * while the thread is on a run queue; otherwise only touched
+	 * on the thread's own cpu with interrupts off.
+	 */
+	unsigned t_priority;		/* MLFQ level, 0 = highest */
+	unsigned t_ticks;		/* Hardclocks used at this level */
+	unsigned t_waitperiods;		/* schedule() passes spent ready */
+	unsigned t_queuedat;		/* t_cpu's c_hardclocks when queued */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -158,14 +174,22 @@ __DEAD void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Charge a hardclock to the current thread. Returns true if the
+ * thread has used up its quantum or a higher-priority thread is
+ * waiting, in which case the caller should yield. Called from the
+ * timer interrupt.
+ */
+bool thread_tick(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Potentially pull ready threads over from busier CPUs. Called from
+ * the timer interrupt.
  */
 void thread_consider_migration(void);
 
@@ -81,6 +81,20 @@ int vfs_lookup(char *path, struct vnode **result);
 int vfs_lookparent(char *path, struct vnode **result,
 		   char *buf, size_t buflen);
 
+/*
+ * Name cache used by vfs_lookup and vfs_lookparent (vfslookup.c).
+ *
+ *    vfs_ncache_remove  - Forget one name in a directory. Called after
+ *                         every operation that creates or removes it.
+ *    vfs_ncache_purgefs - Forget everything on a filesystem, dropping
+ *                         the vnode references held; called before
+ *                         unmounting it.
+ */
+
+void vfs_ncache_bootstrap(void);
+void vfs_ncache_remove(struct vnode *dir, const char *name);
+void vfs_ncache_purgefs(struct fs *fs);
+
 /*
  * VFS layer high-level operations on pathnames
  * Because lookup may destroy pathnames, these all may too.
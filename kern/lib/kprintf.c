@@ -74,18 +74,47 @@ kprintf_bootstrap(void)
 }
 
 /*
- * Send characters to the console. Backend for __printf.
+ * Output staging for one kprintf. __printf hands us the format
+ * string a character at a time; collecting it here lets the console
+ * take it a buffer at a time.
  */
+#define KPRINTF_BUFSIZE 128
+
+struct kprintf_buf {
+	char kb_data[KPRINTF_BUFSIZE];
+	size_t kb_len;
+};
+
 static
 void
-console_send(void *junk, const char *data, size_t len)
+console_flush(struct kprintf_buf *kb)
 {
-	size_t i;
-
-	(void)junk;
+	putbuf(kb->kb_data, kb->kb_len);
+	kb->kb_len = 0;
+}
 
-	for (i=0; i<len; i++) {
-		putch(data[i]);
+/*
+ * Send characters to the console. Backend for __printf.
+ */
+static
+void
+console_send(void *vkb, const char *data, size_t len)
+{
+	struct kprintf_buf *kb = vkb;
+	size_t n;
+
+	while (len > 0) {
+		n = KPRINTF_BUFSIZE - kb->kb_len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(kb->kb_data + kb->kb_len, data, n);
+		kb->kb_len += n;
+		data += n;
+		len -= n;
+		if (kb->kb_len == KPRINTF_BUFSIZE) {
+			console_flush(kb);
+		}
 	}
 }
 
@@ -98,6 +127,7 @@ kprintf(const char *fmt, ...)
 	int chars;
 	va_list ap;
 	bool dolock;
+	struct kprintf_buf kb;
 
 	dolock = kprintf_lock != NULL
 		&& curthread->t_in_interrupt == false
@@ -111,9 +141,11 @@ kprintf(const char *fmt, ...)
 		spinlock_acquire(&kprintf_spinlock);
 	}
 
+	kb.kb_len = 0;
 	va_start(ap, fmt);
-	chars = __vprintf(console_send, NULL, fmt, ap);
+	chars = __vprintf(console_send, &kb, fmt, ap);
 	va_end(ap);
+	console_flush(&kb);
 
 	if (dolock) {
 		lock_release(kprintf_lock);
@@ -125,6 +157,9 @@ kprintf(const char *fmt, ...)
 	return chars;
 }
 
+/* Set once panic() has been called */
+volatile bool panicking;
+
 /*
  * panic() is for fatal errors. It prints the printf arguments it's
  * passed and then halts the system.
@@ -134,6 +169,7 @@ void
 panic(const char *fmt, ...)
 {
 	va_list ap;
+	struct kprintf_buf kb;
 
 	/*
 	 * When we reach panic, the system is usually fairly screwed up.
@@ -150,6 +186,7 @@ panic(const char *fmt, ...)
 
 	if (evil == 0) {
 		evil = 1;
+		panicking = true;
 
 		/*
 		 * Not only do we not want to be interrupted while
@@ -172,9 +209,11 @@ panic(const char *fmt, ...)
 
 		/* Print the message. */
 		kprintf("panic: ");
+		kb.kb_len = 0;
 		va_start(ap, fmt);
-		__vprintf(console_send, NULL, fmt, ap);
+		__vprintf(console_send, &kb, fmt, ap);
 		va_end(ap);
+		console_flush(&kb);
 	}
 
 	if (evil == 3) {
@@ -35,6 +35,7 @@
 #include <lib.h>
 #include <uio.h>
 #include <clock.h>
+#include <cpu.h>
 #include <mainbus.h>
 #include <synch.h>
 #include <thread.h>
@@ -492,6 +493,44 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_cpustats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	cpu_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	lockstat_print();
+
+	return 0;
+}
+
+#if OPT_SFS
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sfs_bufstats();
+
+	return 0;
+}
+#endif
+
 static
 int
 cmd_vmstats(int nargs, char **args)
@@ -580,6 +619,7 @@ static const char *testmenu[] = {
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
 	"[sy4] CV test #2            (1)     ",
+	"[sy5] RW lock test                  ",
 	"[semu1-22] Semaphore unit tests     ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress                ",
@@ -611,6 +651,11 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[cs] CPU scheduler stats            ",
+	"[ls] Lock contention stats          ",
+#if OPT_SFS
+	"[bc] SFS buffer cache stats         ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -662,6 +707,11 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "cs",		cmd_cpustats },
+	{ "ls",		cmd_lockstats },
+#if OPT_SFS
+	{ "bc",		cmd_bufstats },
+#endif
 	{ "vmstats", 	cmd_vmstats },
 
 	/* base system tests */
@@ -685,6 +735,7 @@ static struct {
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
+	{ "sy5",	rwtest },
 
 	/* semaphore unit tests */
 	{ "semu1",	semu1 },
@@ -43,22 +43,41 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <limits.h>
 #include <spl.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
+#include <openfile.h>
 
 #if OPT_WAITPID
 #include <synch.h>
 
-#define MAX_PROC 100
-static struct _processTable {
-  int active;           /* initial value 0 */
-  struct proc *proc[MAX_PROC+1]; /* [0] not used. pids are >= 1 */
-  int last_i;           /* index of last allocated pid */
-  struct spinlock lk;	/* Lock for this table */
-} processTable;
+/*
+ * PID map: a bitmap of pids in use plus a hash table from pid to
+ * proc, chained through p_hashnext. Both start small and double
+ * (up to PID_MAX+1 pids) once more than 3/4 of the pids are taken,
+ * so that the scan for a free bit stays short and the hash chains
+ * stay around PIDMAP_LOAD long.
+ *
+ * Pid 0 is never handed out; the kernel process gets pid 1 and
+ * user processes start at PID_MIN. Allocation continues from just
+ * after the last pid handed out, so pids are not reused right away.
+ */
+#define PIDMAP_INITIAL	256		/* pids; power of 2, >= 32 */
+#define PIDMAP_MAX	(PID_MAX+1)	/* ditto */
+#define PIDMAP_LOAD	4		/* pids per hash bucket */
+
+static struct pidmap {
+	uint32_t *pm_bits;		/* 1 = pid in use */
+	struct proc **pm_hash;		/* pm_npids/PIDMAP_LOAD buckets */
+	unsigned pm_npids;		/* size of the pid space */
+	unsigned pm_nfree;		/* free pids in it */
+	unsigned pm_next;		/* where to start looking */
+	struct spinlock pm_lock;	/* lock for the whole map */
+} pidmap;
 
 #endif
 /*
@@ -66,17 +85,212 @@ static struct _processTable {
  */
 struct proc *kproc;
 
+#if OPT_WAITPID
+/*
+ * Allocate the initial pid map. Pid 0 is marked in use for good.
+ */
+static
+void
+pidmap_bootstrap(void)
+{
+	unsigned i;
+
+	pidmap.pm_bits = kmalloc(PIDMAP_INITIAL / 32 * sizeof(uint32_t));
+	pidmap.pm_hash = kmalloc(PIDMAP_INITIAL / PIDMAP_LOAD *
+				 sizeof(struct proc *));
+	if (pidmap.pm_bits == NULL || pidmap.pm_hash == NULL) {
+		panic("pidmap_bootstrap: out of memory\n");
+	}
+	for (i=0; i<PIDMAP_INITIAL / 32; i++) {
+		pidmap.pm_bits[i] = 0;
+	}
+	for (i=0; i<PIDMAP_INITIAL / PIDMAP_LOAD; i++) {
+		pidmap.pm_hash[i] = NULL;
+	}
+	pidmap.pm_bits[0] = 1;
+	pidmap.pm_npids = PIDMAP_INITIAL;
+	pidmap.pm_nfree = PIDMAP_INITIAL - 1;
+	pidmap.pm_next = 1;
+	spinlock_init(&pidmap.pm_lock);
+}
+
+static
+unsigned
+pidmap_bucket(pid_t pid, unsigned npids)
+{
+	return (unsigned)pid & (npids / PIDMAP_LOAD - 1);
+}
+
+/*
+ * Swap in bigger arrays of NEWN pids. Returns the old ones through
+ * the same pointers so the caller can free them after unlocking.
+ */
+static
+void
+pidmap_install(uint32_t **bitsp, struct proc ***hashp, unsigned newn)
+{
+	uint32_t *newbits = *bitsp;
+	struct proc **newhash = *hashp;
+	struct proc *p, *next;
+	unsigned i, b;
+
+	KASSERT(spinlock_do_i_hold(&pidmap.pm_lock));
+
+	for (i=0; i<newn / 32; i++) {
+		newbits[i] = i < pidmap.pm_npids / 32 ? pidmap.pm_bits[i] : 0;
+	}
+	for (i=0; i<newn / PIDMAP_LOAD; i++) {
+		newhash[i] = NULL;
+	}
+	for (i=0; i<pidmap.pm_npids / PIDMAP_LOAD; i++) {
+		for (p = pidmap.pm_hash[i]; p != NULL; p = next) {
+			next = p->p_hashnext;
+			b = pidmap_bucket(p->p_pid, newn);
+			p->p_hashnext = newhash[b];
+			newhash[b] = p;
+		}
+	}
+
+	*bitsp = pidmap.pm_bits;
+	*hashp = pidmap.pm_hash;
+	pidmap.pm_bits = newbits;
+	pidmap.pm_hash = newhash;
+	/* continue in the new, empty part rather than recycling pids */
+	pidmap.pm_next = pidmap.pm_npids;
+	pidmap.pm_nfree += newn - pidmap.pm_npids;
+	pidmap.pm_npids = newn;
+}
+
+static
+bool
+pidmap_wantgrow(void)
+{
+	return pidmap.pm_npids < PIDMAP_MAX &&
+		pidmap.pm_nfree < pidmap.pm_npids / 4;
+}
+
+/*
+ * Give PROC a pid and enter it in the map. Returns ENPROC if all
+ * pids are in use. Growing the map needs kmalloc, which cannot be
+ * done under the spinlock, so allocate unlocked and install only if
+ * nobody else grew the map meanwhile. If the memory isn't there, just
+ * keep using the map we have.
+ */
+static
+int
+pidmap_alloc(struct proc *proc)
+{
+	uint32_t *newbits;
+	struct proc **newhash;
+	unsigned n, w, bit, words, pid;
+
+	spinlock_acquire(&pidmap.pm_lock);
+	while (pidmap_wantgrow()) {
+		n = pidmap.pm_npids;
+		spinlock_release(&pidmap.pm_lock);
+
+		newbits = kmalloc(2 * n / 32 * sizeof(uint32_t));
+		newhash = kmalloc(2 * n / PIDMAP_LOAD * sizeof(struct proc *));
+		if (newbits == NULL || newhash == NULL) {
+			kfree(newbits);
+			kfree(newhash);
+			spinlock_acquire(&pidmap.pm_lock);
+			break;
+		}
+
+		spinlock_acquire(&pidmap.pm_lock);
+		if (pidmap.pm_npids == n) {
+			pidmap_install(&newbits, &newhash, 2 * n);
+		}
+		spinlock_release(&pidmap.pm_lock);
+		/* now either the old arrays, or ours if we lost the race */
+		kfree(newbits);
+		kfree(newhash);
+		spinlock_acquire(&pidmap.pm_lock);
+	}
+
+	if (pidmap.pm_nfree == 0) {
+		spinlock_release(&pidmap.pm_lock);
+		return ENPROC;
+	}
+
+	/* find a word with a clear bit, starting from pm_next */
+	words = pidmap.pm_npids / 32;
+	w = (pidmap.pm_next / 32) % words;
+	bit = pidmap.pm_next % 32;
+	while (1) {
+		if (pidmap.pm_bits[w] != 0xffffffff) {
+			for (; bit < 32; bit++) {
+				if ((pidmap.pm_bits[w] & (1U << bit)) == 0) {
+					break;
+				}
+			}
+			if (bit < 32) {
+				break;
+			}
+		}
+		w = (w + 1) % words;
+		bit = 0;
+	}
+
+	pid = w * 32 + bit;
+	pidmap.pm_bits[w] |= 1U << bit;
+	pidmap.pm_nfree--;
+	pidmap.pm_next = pid + 1;
+
+	proc->p_pid = pid;
+	n = pidmap_bucket(pid, pidmap.pm_npids);
+	proc->p_hashnext = pidmap.pm_hash[n];
+	pidmap.pm_hash[n] = proc;
+	spinlock_release(&pidmap.pm_lock);
+
+	return 0;
+}
+
+static
+void
+pidmap_free(struct proc *proc)
+{
+	struct proc **pp;
+	pid_t pid = proc->p_pid;
+
+	spinlock_acquire(&pidmap.pm_lock);
+	KASSERT(pid > 0 && (unsigned)pid < pidmap.pm_npids);
+	KASSERT(pidmap.pm_bits[pid / 32] & (1U << (pid % 32)));
+	pidmap.pm_bits[pid / 32] &= ~(1U << (pid % 32));
+	pidmap.pm_nfree++;
+
+	pp = &pidmap.pm_hash[pidmap_bucket(pid, pidmap.pm_npids)];
+	while (*pp != proc) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->p_hashnext;
+	}
+	*pp = proc->p_hashnext;
+	proc->p_hashnext = NULL;
+	spinlock_release(&pidmap.pm_lock);
+}
+#endif /* OPT_WAITPID */
+
 /*
  * G.Cabodi - 2019
- * Initialize support for pid/waitpid.
+ * Find the process with a given pid. Returns NULL if there is none.
  */
 struct proc *
 proc_search_pid(pid_t pid) {
 #if OPT_WAITPID
   struct proc *p;
-  KASSERT(pid>=0&&pid<MAX_PROC);
-  p = processTable.proc[pid];
-  KASSERT(p->p_pid==pid);
+
+  spinlock_acquire(&pidmap.pm_lock);
+  if (pid <= 0 || (unsigned)pid >= pidmap.pm_npids) {
+    p = NULL;
+  }
+  else {
+    p = pidmap.pm_hash[pidmap_bucket(pid, pidmap.pm_npids)];
+    while (p != NULL && p->p_pid != pid) {
+      p = p->p_hashnext;
+    }
+  }
+  spinlock_release(&pidmap.pm_lock);
   return p;
 #else
   (void)pid;
@@ -88,32 +302,22 @@ proc_search_pid(pid_t pid) {
  * G.Cabodi - 2019
  * Initialize support for pid/waitpid.
  */
-static void
+static int
 proc_init_waitpid(struct proc *proc, const char *name) {
 #if OPT_WAITPID
-  /* search a free index in table using a circular strategy */
-  int i;
-  spinlock_acquire(&processTable.lk);
-  i = processTable.last_i+1;
-  proc->p_pid = 0;
-  if (i>MAX_PROC) i=1;
-  while (i!=processTable.last_i) {
-    if (processTable.proc[i] == NULL) {
-      processTable.proc[i] = proc;
-      processTable.last_i = i;
-      proc->p_pid = i;
-      break;
-    }
-    i++;
-    if (i>MAX_PROC) i=1;
-  }
-  spinlock_release(&processTable.lk);
-  if (proc->p_pid==0) {
-    panic("too many processes. proc table is full\n");
+  int result;
+
+  result = pidmap_alloc(proc);
+  if (result) {
+    return result;
   }
   proc->p_status = 0;
 #if USE_SEMAPHORE_FOR_WAITPID
   proc->p_sem = sem_create(name, 0);
+  if (proc->p_sem == NULL) {
+    pidmap_free(proc);
+    return ENOMEM;
+  }
 #else
   proc->p_cv = cv_create(name);
   proc->p_lock = lock_create(name);
@@ -122,6 +326,7 @@ proc_init_waitpid(struct proc *proc, const char *name) {
   (void)proc;
   (void)name;
 #endif
+  return 0;
 }
 
 /*
@@ -131,13 +336,8 @@ proc_init_waitpid(struct proc *proc, const char *name) {
 static void
 proc_end_waitpid(struct proc *proc) {
 #if OPT_WAITPID
-  /* remove the process from the table */
-  int i;
-  spinlock_acquire(&processTable.lk);
-  i = proc->p_pid;
-  KASSERT(i>0 && i<=MAX_PROC);
-  processTable.proc[i] = NULL;
-  spinlock_release(&processTable.lk);
+  /* remove the process from the pid map */
+  pidmap_free(proc);
 
 #if USE_SEMAPHORE_FOR_WAITPID
   sem_destroy(proc->p_sem);
@@ -151,22 +351,24 @@ proc_end_waitpid(struct proc *proc) {
 }
 
 /*
- * Create a proc structure.
+ * Create a proc structure. Fails with ENOMEM, or ENPROC if there are
+ * no pids left.
  */
 static
-struct proc *
-proc_create(const char *name)
+int
+proc_create(const char *name, struct proc **ret)
 {
 	struct proc *proc;
+	int result;
 
 	proc = kmalloc(sizeof(*proc));
 	if (proc == NULL) {
-		return NULL;
+		return ENOMEM;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
 		kfree(proc);
-		return NULL;
+		return ENOMEM;
 	}
 
 	proc->p_numthreads = 0;
@@ -177,10 +379,20 @@ proc_create(const char *name)
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
+#if OPT_FILE
+	filetable_init(proc);
+#endif
 
-	proc_init_waitpid(proc,name);
+	result = proc_init_waitpid(proc,name);
+	if (result) {
+		spinlock_cleanup(&proc->p_lock);
+		kfree(proc->p_name);
+		kfree(proc);
+		return result;
+	}
 
-	return proc;
+	*ret = proc;
+	return 0;
 }
 
 /*
@@ -210,6 +422,9 @@ proc_destroy(struct proc *proc)
 	 */
 
 	/* VFS fields */
+#if OPT_FILE
+	filetable_closeall(proc);
+#endif
 	if (proc->p_cwd) {
 		VOP_DECREF(proc->p_cwd);
 		proc->p_cwd = NULL;
@@ -278,15 +493,13 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
-	kproc = proc_create("[kernel]");
-	if (kproc == NULL) {
-		panic("proc_create for kproc failed\n");
-	}
 #if OPT_WAITPID
-	spinlock_init(&processTable.lk);
-	/* kernel process is not registered in the table */
-	processTable.active = 1;
+	/* the kernel process takes pid 1 */
+	pidmap_bootstrap();
 #endif
+	if (proc_create("[kernel]", &kproc)) {
+		panic("proc_create for kproc failed\n");
+	}
 }
 
 
@@ -301,10 +514,34 @@ proc_create_runprogram(const char *name)
 {
 	struct proc *newproc;
 
-	newproc = proc_create(name);
-	if (newproc == NULL) {
+	if (proc_create_child(name, &newproc)) {
 		return NULL;
 	}
+#if OPT_FILE
+	/* a fresh program gets the console as stdin/stdout/stderr */
+	if (filetable_openstd(newproc)) {
+		proc_destroy(newproc);
+		return NULL;
+	}
+#endif
+	return newproc;
+}
+
+/*
+ * Same as proc_create_runprogram, but returns an error code: ENOMEM,
+ * or ENPROC when the system is out of pids, and leaves the file table
+ * empty for the caller to fill. Used by fork.
+ */
+int
+proc_create_child(const char *name, struct proc **ret)
+{
+	struct proc *newproc;
+	int result;
+
+	result = proc_create(name, &newproc);
+	if (result) {
+		return result;
+	}
 
 	/* VM fields */
 
@@ -324,7 +561,8 @@ proc_create_runprogram(const char *name)
 	}
 	spinlock_release(&curproc->p_lock);
 
-	return newproc;
+	*ret = newproc;
+	return 0;
 }
 
 /*
@@ -2,31 +2,257 @@
  * AUthor: G.Cabodi
  * Very simple implementation of sys_read and sys_write.
  * just works (partially) on stdin/stdout
+ *
+ * With option "file", the full set (open/close/read/write/lseek/dup2)
+ * on top of the per-process file table in openfile.h.
  */
 
 #include <types.h>
 #include <kern/unistd.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/seek.h>
+#include <kern/stat.h>
 #include <clock.h>
 #include <copyinout.h>
 #include <syscall.h>
 #include <lib.h>
+#include <limits.h>
+#include <uio.h>
+#include <proc.h>
+#include <current.h>
+#include <synch.h>
+#include <vnode.h>
+#include <openfile.h>
+
+#if OPT_FILE
+
+int
+sys_open(userptr_t upath, int flags, mode_t mode, int *retval)
+{
+  struct openfile *of;
+  char *path;
+  int result, fd;
+
+  switch (flags & O_ACCMODE) {
+  case O_RDONLY:
+  case O_WRONLY:
+  case O_RDWR:
+    break;
+  default:
+    return EINVAL;
+  }
+
+  path = kmalloc(PATH_MAX);
+  if (path == NULL) {
+    return ENOMEM;
+  }
+  result = copyinstr(upath, path, PATH_MAX, NULL);
+  if (result == 0) {
+    result = openfile_open(path, flags, mode, &of);
+  }
+  kfree(path);
+  if (result) {
+    return result;
+  }
+
+  result = filetable_place(curproc, of, &fd);
+  if (result) {
+    openfile_decref(of);
+    return result;
+  }
+  *retval = fd;
+  return 0;
+}
+
+int
+sys_close(int fd)
+{
+  struct openfile *of;
+  int result;
+
+  result = filetable_get(curproc, fd, &of);
+  if (result) {
+    return result;
+  }
+  curproc->p_filetable[fd] = NULL;
+  openfile_decref(of);
+  return 0;
+}
+
+/*
+ * Common part of read and write: one uio straight from/to the user
+ * buffer, at the file's seek position.
+ */
+static int
+file_rw(int fd, userptr_t buf, size_t size, enum uio_rw rw, int *retval)
+{
+  struct openfile *of;
+  struct iovec iov;
+  struct uio u;
+  struct stat st;
+  bool seekable;
+  int result;
+
+  result = filetable_get(curproc, fd, &of);
+  if (result) {
+    return result;
+  }
+  if (of->of_accmode == (rw == UIO_READ ? O_WRONLY : O_RDONLY)) {
+    return EBADF;
+  }
+
+  seekable = VOP_ISSEEKABLE(of->of_vnode);
+  lock_acquire(of->of_lock);
+  if (rw == UIO_WRITE && of->of_append && seekable) {
+    result = VOP_STAT(of->of_vnode, &st);
+    if (result) {
+      lock_release(of->of_lock);
+      return result;
+    }
+    of->of_offset = st.st_size;
+  }
+
+  iov.iov_ubase = buf;
+  iov.iov_len = size;
+  u.uio_iov = &iov;
+  u.uio_iovcnt = 1;
+  u.uio_offset = seekable ? of->of_offset : 0;
+  u.uio_resid = size;
+  u.uio_segflg = UIO_USERSPACE;
+  u.uio_rw = rw;
+  u.uio_space = proc_getas();
+
+  if (rw == UIO_READ) {
+    result = VOP_READ(of->of_vnode, &u);
+  }
+  else {
+    result = VOP_WRITE(of->of_vnode, &u);
+  }
+  if (seekable) {
+    of->of_offset = u.uio_offset;
+  }
+  lock_release(of->of_lock);
+
+  if (result) {
+    return result;
+  }
+  *retval = size - u.uio_resid;
+  return 0;
+}
+
+int
+sys_write(int fd, userptr_t buf_ptr, size_t size, int *retval)
+{
+  return file_rw(fd, buf_ptr, size, UIO_WRITE, retval);
+}
+
+int
+sys_read(int fd, userptr_t buf_ptr, size_t size, int *retval)
+{
+  return file_rw(fd, buf_ptr, size, UIO_READ, retval);
+}
+
+int
+sys_lseek(int fd, off_t pos, int whence, off_t *retval)
+{
+  struct openfile *of;
+  struct stat st;
+  off_t newpos;
+  int result;
+
+  result = filetable_get(curproc, fd, &of);
+  if (result) {
+    return result;
+  }
+  if (!VOP_ISSEEKABLE(of->of_vnode)) {
+    return ESPIPE;
+  }
+
+  lock_acquire(of->of_lock);
+  switch (whence) {
+  case SEEK_SET:
+    newpos = pos;
+    break;
+  case SEEK_CUR:
+    newpos = of->of_offset + pos;
+    break;
+  case SEEK_END:
+    result = VOP_STAT(of->of_vnode, &st);
+    if (result) {
+      lock_release(of->of_lock);
+      return result;
+    }
+    newpos = st.st_size + pos;
+    break;
+  default:
+    lock_release(of->of_lock);
+    return EINVAL;
+  }
+  if (newpos < 0) {
+    lock_release(of->of_lock);
+    return EINVAL;
+  }
+  of->of_offset = newpos;
+  lock_release(of->of_lock);
+
+  *retval = newpos;
+  return 0;
+}
+
+int
+sys_dup2(int oldfd, int newfd, int *retval)
+{
+  struct openfile *of;
+  int result;
+
+  result = filetable_get(curproc, oldfd, &of);
+  if (result) {
+    return result;
+  }
+  if (newfd < 0 || newfd >= OPEN_MAX) {
+    return EBADF;
+  }
+  if (newfd != oldfd) {
+    openfile_incref(of);
+    if (curproc->p_filetable[newfd] != NULL) {
+      openfile_decref(curproc->p_filetable[newfd]);
+    }
+    curproc->p_filetable[newfd] = of;
+  }
+  *retval = newfd;
+  return 0;
+}
+
+#else
 
 /*
  * simple file system calls for write/read
+ * User data is moved with copyin/copyout through a kernel chunk,
+ * and output goes to the console a chunk at a time.
  */
+#define SYSRW_CHUNK 128
+
 int
 sys_write(int fd, userptr_t buf_ptr, size_t size)
 {
-  int i;
-  char *p = (char *)buf_ptr;
+  char kbuf[SYSRW_CHUNK];
+  size_t done, n;
 
   if (fd!=STDOUT_FILENO && fd!=STDERR_FILENO) {
     kprintf("sys_write supported only to stdout\n");
     return -1;
   }
 
-  for (i=0; i<(int)size; i++) {
-    putch(p[i]);
+  for (done=0; done<size; done+=n) {
+    n = size-done;
+    if (n > sizeof(kbuf)) {
+      n = sizeof(kbuf);
+    }
+    if (copyin((const_userptr_t)((vaddr_t)buf_ptr + done), kbuf, n)) {
+      return done > 0 ? (int)done : -1;
+    }
+    putbuf(kbuf, n);
   }
 
   return (int)size;
@@ -35,19 +261,32 @@ sys_write(int fd, userptr_t buf_ptr, size_t size)
 int
 sys_read(int fd, userptr_t buf_ptr, size_t size)
 {
-  int i;
-  char *p = (char *)buf_ptr;
+  char kbuf[SYSRW_CHUNK];
+  size_t done, n;
+  int ch = 0;
 
   if (fd!=STDIN_FILENO) {
     kprintf("sys_read supported only to stdin\n");
     return -1;
   }
 
-  for (i=0; i<(int)size; i++) {
-    p[i] = getch();
-    if (p[i] < 0) 
-      return i;
+  for (done=0; done<size; done+=n) {
+    for (n=0; n<sizeof(kbuf) && done+n<size; n++) {
+      ch = getch();
+      if (ch < 0) {
+        break;
+      }
+      kbuf[n] = ch;
+    }
+    if (copyout(kbuf, (userptr_t)((vaddr_t)buf_ptr + done), n)) {
+      return done > 0 ? (int)done : -1;
+    }
+    if (ch < 0) {
+      return (int)(done+n);
+    }
   }
 
   return (int)size;
-}
\ No newline at end of file
+}
+
+#endif /* OPT_FILE */
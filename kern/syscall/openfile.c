@@ -0,0 +1,157 @@
+/*
+ * Open file objects and per-process descriptor tables.
+ * See openfile.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <synch.h>
+#include <proc.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <openfile.h>
+
+int
+openfile_open(char *path, int flags, mode_t mode, struct openfile **ret)
+{
+	struct openfile *of;
+	int result;
+
+	of = kmalloc(sizeof(*of));
+	if (of == NULL) {
+		return ENOMEM;
+	}
+	of->of_lock = lock_create("openfile");
+	if (of->of_lock == NULL) {
+		kfree(of);
+		return ENOMEM;
+	}
+
+	result = vfs_open(path, flags, mode, &of->of_vnode);
+	if (result) {
+		lock_destroy(of->of_lock);
+		kfree(of);
+		return result;
+	}
+
+	of->of_accmode = flags & O_ACCMODE;
+	of->of_append = (flags & O_APPEND) != 0;
+	of->of_offset = 0;
+	of->of_refcount = 1;
+	spinlock_init(&of->of_reflock);
+
+	*ret = of;
+	return 0;
+}
+
+void
+openfile_incref(struct openfile *of)
+{
+	spinlock_acquire(&of->of_reflock);
+	of->of_refcount++;
+	spinlock_release(&of->of_reflock);
+}
+
+void
+openfile_decref(struct openfile *of)
+{
+	bool last;
+
+	spinlock_acquire(&of->of_reflock);
+	KASSERT(of->of_refcount > 0);
+	of->of_refcount--;
+	last = of->of_refcount == 0;
+	spinlock_release(&of->of_reflock);
+
+	if (last) {
+		vfs_close(of->of_vnode);
+		spinlock_cleanup(&of->of_reflock);
+		lock_destroy(of->of_lock);
+		kfree(of);
+	}
+}
+
+void
+filetable_init(struct proc *p)
+{
+	int fd;
+
+	for (fd=0; fd<OPEN_MAX; fd++) {
+		p->p_filetable[fd] = NULL;
+	}
+}
+
+int
+filetable_openstd(struct proc *p)
+{
+	static const int modes[3] = { O_RDONLY, O_WRONLY, O_WRONLY };
+	char path[5];
+	int fd, result;
+
+	for (fd=0; fd<3; fd++) {
+		KASSERT(p->p_filetable[fd] == NULL);
+		/* vfs_open may clobber the name */
+		strcpy(path, "con:");
+		result = openfile_open(path, modes[fd], 0,
+				       &p->p_filetable[fd]);
+		if (result) {
+			filetable_closeall(p);
+			return result;
+		}
+	}
+	return 0;
+}
+
+void
+filetable_copy(struct proc *src, struct proc *dst)
+{
+	int fd;
+
+	for (fd=0; fd<OPEN_MAX; fd++) {
+		KASSERT(dst->p_filetable[fd] == NULL);
+		if (src->p_filetable[fd] != NULL) {
+			openfile_incref(src->p_filetable[fd]);
+			dst->p_filetable[fd] = src->p_filetable[fd];
+		}
+	}
+}
+
+void
+filetable_closeall(struct proc *p)
+{
+	int fd;
+
+	for (fd=0; fd<OPEN_MAX; fd++) {
+		if (p->p_filetable[fd] != NULL) {
+			openfile_decref(p->p_filetable[fd]);
+			p->p_filetable[fd] = NULL;
+		}
+	}
+}
+
+int
+filetable_get(struct proc *p, int fd, struct openfile **ret)
+{
+	if (fd < 0 || fd >= OPEN_MAX || p->p_filetable[fd] == NULL) {
+		return EBADF;
+	}
+	*ret = p->p_filetable[fd];
+	return 0;
+}
+
+int
+filetable_place(struct proc *p, struct openfile *of, int *ret)
+{
+	int fd;
+
+	for (fd=0; fd<OPEN_MAX; fd++) {
+		if (p->p_filetable[fd] == NULL) {
+			p->p_filetable[fd] = of;
+			*ret = fd;
+			return 0;
+		}
+	}
+	return EMFILE;
+}
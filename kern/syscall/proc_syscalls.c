@@ -8,6 +8,8 @@
 #include <types.h>
 #include <kern/unistd.h>
 #include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <limits.h>
 #include <clock.h>
 #include <copyinout.h>
 #include <syscall.h>
@@ -18,6 +20,9 @@
 #include <mips/trapframe.h>
 #include <current.h>
 #include <synch.h>
+#include <vm.h>
+#include <vfs.h>
+#include <openfile.h>
 
 /*
  * system calls for process management
@@ -28,6 +33,10 @@ sys__exit(int status)
 #if OPT_WAITPID
   struct proc *p = curproc;
   p->p_status = status & 0xff; /* just lower 8 bits returned */
+#if OPT_FILE
+  /* let go of open files now, not when the parent gets to waitpid */
+  filetable_closeall(p);
+#endif
   proc_remthread(curthread);
 #if USE_SEMAPHORE_FOR_WAITPID
   V(p->p_sem);
@@ -95,11 +104,17 @@ int sys_fork(struct trapframe *ctf, pid_t *retval) {
 
   KASSERT(curproc != NULL);
 
-  newp = proc_create_runprogram(curproc->p_name);
-  if (newp == NULL) {
-    return ENOMEM;
+  /* ENPROC when out of pids: fork bombs fail instead of panicking */
+  result = proc_create_child(curproc->p_name, &newp);
+  if (result) {
+    return result;
   }
 
+#if OPT_FILE
+  /* the child shares the parent's open files, seek positions and all */
+  filetable_copy(curproc, newp);
+#endif
+
   /* done here as we need to duplicate the address space 
      of thbe current process */
   as_copy(curproc->p_addrspace, &(newp->p_addrspace));
@@ -135,3 +150,263 @@ int sys_fork(struct trapframe *ctf, pid_t *retval) {
   return 0;
 }
 #endif
+
+/*
+ * execv support.
+ *
+ * The argument strings are copied in back to back, NUL-terminated,
+ * into a chain of whole pages allocated as they fill up, so a single
+ * string may straddle pages. This costs at most ARG_MAX bytes of
+ * kernel memory per exec and no allocation per argument; the user
+ * argv pointers are not kept, just recomputed when copying out.
+ */
+#define EXECARGS_NPAGES (ARG_MAX / PAGE_SIZE)
+
+struct execargs {
+  char *ea_pages[EXECARGS_NPAGES];
+  unsigned ea_npages;
+  size_t ea_len;          /* bytes of string data */
+  int ea_argc;
+};
+
+static void
+execargs_init(struct execargs *ea) {
+  ea->ea_npages = 0;
+  ea->ea_len = 0;
+  ea->ea_argc = 0;
+}
+
+static void
+execargs_cleanup(struct execargs *ea) {
+  unsigned i;
+
+  for (i=0; i<ea->ea_npages; i++) {
+    kfree(ea->ea_pages[i]);
+  }
+  ea->ea_npages = 0;
+}
+
+/* strings plus the argv array (with its NULL) must fit in ARG_MAX */
+static bool
+execargs_fits(struct execargs *ea, size_t morelen) {
+  return ea->ea_len + morelen +
+    (ea->ea_argc + 2) * sizeof(userptr_t) <= ARG_MAX;
+}
+
+/*
+ * Append the user string USTR, including its NUL.
+ */
+static int
+execargs_addstr(struct execargs *ea, const_userptr_t ustr) {
+  size_t off, space, got;
+  int result;
+
+  while (1) {
+    off = ea->ea_len % PAGE_SIZE;
+    if (off == 0 && ea->ea_len / PAGE_SIZE == ea->ea_npages) {
+      /* current page is full (or there is none yet) */
+      if (ea->ea_npages == EXECARGS_NPAGES) {
+        return E2BIG;
+      }
+      ea->ea_pages[ea->ea_npages] = kmalloc(PAGE_SIZE);
+      if (ea->ea_pages[ea->ea_npages] == NULL) {
+        return ENOMEM;
+      }
+      ea->ea_npages++;
+    }
+    space = PAGE_SIZE - off;
+    if (!execargs_fits(ea, 1)) {
+      return E2BIG;
+    }
+    result = copyinstr(ustr, ea->ea_pages[ea->ea_len / PAGE_SIZE] + off,
+                       space, &got);
+    if (result == 0) {
+      if (!execargs_fits(ea, got)) {
+        return E2BIG;
+      }
+      ea->ea_len += got;
+      ea->ea_argc++;
+      return 0;
+    }
+    if (result != ENAMETOOLONG) {
+      return result;
+    }
+    /* filled the rest of this page; carry on in the next one */
+    if (!execargs_fits(ea, space)) {
+      return E2BIG;
+    }
+    ea->ea_len += space;
+    ustr = (const_userptr_t)((vaddr_t)ustr + space);
+  }
+}
+
+static int
+execargs_copyin(struct execargs *ea, userptr_t uargv) {
+  userptr_t uarg;
+  int result;
+
+  while (1) {
+    result = copyin((const_userptr_t)((vaddr_t)uargv +
+                                      ea->ea_argc * sizeof(userptr_t)),
+                    &uarg, sizeof(uarg));
+    if (result) {
+      return result;
+    }
+    if (uarg == NULL) {
+      return 0;
+    }
+    result = execargs_addstr(ea, uarg);
+    if (result) {
+      return result;
+    }
+  }
+}
+
+/*
+ * Lay out the arguments at the top of the (current, new) user stack:
+ * the argv array at the new stack pointer, the strings above it.
+ */
+static int
+execargs_copyout(struct execargs *ea, vaddr_t *stackptr, userptr_t *uargvp) {
+  vaddr_t strbase, argvbase;
+  userptr_t ptrs[64];
+  size_t off, len;
+  unsigned i, n;
+  bool start;
+  int result;
+
+  strbase = *stackptr - ROUNDUP(ea->ea_len, 8);
+  argvbase = strbase - ROUNDUP((ea->ea_argc + 1) * sizeof(userptr_t), 8);
+
+  for (i=0; i<ea->ea_npages; i++) {
+    len = ea->ea_len - i * PAGE_SIZE;
+    if (len > PAGE_SIZE) {
+      len = PAGE_SIZE;
+    }
+    result = copyout(ea->ea_pages[i], (userptr_t)(strbase + i * PAGE_SIZE),
+                     len);
+    if (result) {
+      return result;
+    }
+  }
+
+  /* each string starts right after the previous NUL; batch the copyouts */
+  n = 0;
+  i = 0;
+  start = true;
+  for (off=0; off<=ea->ea_len; off++) {
+    if (off == ea->ea_len || start) {
+      ptrs[n++] = off == ea->ea_len ? NULL : (userptr_t)(strbase + off);
+      if (n == sizeof(ptrs) / sizeof(ptrs[0]) || off == ea->ea_len) {
+        result = copyout(ptrs, (userptr_t)(argvbase + i * sizeof(userptr_t)),
+                         n * sizeof(userptr_t));
+        if (result) {
+          return result;
+        }
+        i += n;
+        n = 0;
+      }
+    }
+    if (off < ea->ea_len) {
+      start = ea->ea_pages[off / PAGE_SIZE][off % PAGE_SIZE] == '\0';
+    }
+  }
+  KASSERT(i == (unsigned)ea->ea_argc + 1);
+
+  *stackptr = argvbase;
+  *uargvp = (userptr_t)argvbase;
+  return 0;
+}
+
+/*
+ * Replace the current process image. The new program is loaded into a
+ * fresh address space; the old one is kept until nothing can fail any
+ * more, so on error we go back to it and return to the caller.
+ */
+int
+sys_execv(userptr_t uprogname, userptr_t uargv) {
+  struct execargs ea;
+  struct addrspace *oldas, *newas;
+  struct vnode *v;
+  vaddr_t entrypoint, stackptr;
+  userptr_t uargv_new;
+  char *progname, *newname;
+  int result;
+
+  progname = kmalloc(PATH_MAX);
+  if (progname == NULL) {
+    return ENOMEM;
+  }
+  result = copyinstr(uprogname, progname, PATH_MAX, NULL);
+  if (result) {
+    kfree(progname);
+    return result;
+  }
+  newname = kstrdup(progname);
+  if (newname == NULL) {
+    kfree(progname);
+    return ENOMEM;
+  }
+
+  execargs_init(&ea);
+  result = execargs_copyin(&ea, uargv);
+  if (result) {
+    goto fail_args;
+  }
+
+  /* vfs_open may clobber progname, hence the copy above */
+  result = vfs_open(progname, O_RDONLY, 0, &v);
+  if (result) {
+    goto fail_args;
+  }
+
+  newas = as_create();
+  if (newas == NULL) {
+    vfs_close(v);
+    result = ENOMEM;
+    goto fail_args;
+  }
+  oldas = proc_setas(newas);
+  as_activate();
+
+  result = load_elf(v, &entrypoint);
+  vfs_close(v);
+  if (result) {
+    goto fail_as;
+  }
+  result = as_define_stack(newas, &stackptr);
+  if (result) {
+    goto fail_as;
+  }
+  result = execargs_copyout(&ea, &stackptr, &uargv_new);
+  if (result) {
+    goto fail_as;
+  }
+
+  /* point of no return */
+  if (oldas != NULL) {
+    as_destroy(oldas);
+  }
+  execargs_cleanup(&ea);
+  kfree(progname);
+
+  spinlock_acquire(&curproc->p_lock);
+  progname = curproc->p_name;
+  curproc->p_name = newname;
+  spinlock_release(&curproc->p_lock);
+  kfree(progname);
+
+  enter_new_process(ea.ea_argc, uargv_new, NULL /*env*/,
+                    stackptr, entrypoint);
+  panic("enter_new_process returned\n");
+
+fail_as:
+  proc_setas(oldas);
+  as_activate();
+  as_destroy(newas);
+fail_args:
+  execargs_cleanup(&ea);
+  kfree(newname);
+  kfree(progname);
+  return result;
+}
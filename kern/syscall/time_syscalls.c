@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <clock.h>
 #include <copyinout.h>
 #include <syscall.h>
@@ -56,3 +57,36 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/*
+ * Sleep for the time given in the timespec at USER_REQ. There are no
+ * signals to interrupt the sleep, so if USER_REMAINDER is given the
+ * time left is always zero.
+ */
+int
+sys_nanosleep(userptr_t user_req, userptr_t user_remainder)
+{
+	struct timespec ts;
+	int result;
+
+	result = copyin(user_req, &ts, sizeof(ts));
+	if (result) {
+		return result;
+	}
+	if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+
+	clocknanosleep(&ts);
+
+	if (user_remainder != NULL) {
+		ts.tv_sec = 0;
+		ts.tv_nsec = 0;
+		result = copyout(&ts, user_remainder, sizeof(ts));
+		if (result) {
+			return result;
+		}
+	}
+
+	return 0;
+}
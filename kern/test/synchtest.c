@@ -399,3 +399,130 @@ cvtest2(int nargs, char **args)
 	kprintf("cvtest2 done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Reader-writer lock test.
+ *
+ * Writers update testval1..3 together under the write lock; readers
+ * check under the read lock that they never see a half-done update.
+ * Every fourth thread reads, then upgrades to write; if the upgrade
+ * loses to another upgrader it falls back to release+acquire.
+ */
+
+#define NRWLOOPS 60
+
+static struct rwlock *testrw;
+
+static
+void
+rwfail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: Mismatch on %s\n", num, msg);
+	kprintf("Test failed\n");
+}
+
+static
+void
+rwcheck(unsigned long num)
+{
+	unsigned long v1, v2, v3;
+	volatile int j;
+
+	v1 = testval1;
+	for (j=0; j<50; j++);
+	v2 = testval2;
+	v3 = testval3;
+	if (v2 != v1*v1) {
+		rwfail(num, "testval2/testval1");
+	}
+	if (v3 != v1%3) {
+		rwfail(num, "testval3/testval1");
+	}
+}
+
+static
+void
+rwupdate(unsigned long num)
+{
+	volatile int j;
+
+	testval1 = num;
+	for (j=0; j<50; j++);
+	testval2 = num*num;
+	testval3 = num%3;
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i;
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		switch ((num + i) % 4) {
+		    case 0:
+			rwlock_acquire_write(testrw);
+			KASSERT(rwlock_do_i_hold_write(testrw));
+			rwupdate(num);
+			rwcheck(num);
+			rwlock_release_write(testrw);
+			break;
+		    case 1:
+			rwlock_acquire_read(testrw);
+			rwcheck(num);
+			if (!rwlock_tryupgrade(testrw)) {
+				rwlock_release_read(testrw);
+				rwlock_acquire_write(testrw);
+			}
+			rwupdate(num);
+			rwlock_downgrade(testrw);
+			rwcheck(num);
+			rwlock_release_read(testrw);
+			break;
+		    default:
+			rwlock_acquire_read(testrw);
+			rwcheck(num);
+			rwlock_release_read(testrw);
+			break;
+		}
+	}
+	V(donesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	testrw = rwlock_create("testrw");
+	if (testrw == NULL) {
+		panic("rwtest: rwlock_create failed\n");
+	}
+	testval1 = testval2 = testval3 = 0;
+
+	kprintf("Starting rwlock test...\n");
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	rwlock_destroy(testrw);
+	testrw = NULL;
+
+	kprintf("Rwlock test done.\n");
+	return 0;
+}
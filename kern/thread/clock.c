@@ -30,6 +30,7 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spinlock.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
@@ -38,9 +39,12 @@
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution than one second.
+ * hardclock() runs HZ times a second on each busy cpu and drives the
+ * scheduler. Timed events (sleeps and the like) are kept separately,
+ * in a hierarchical timer wheel, and are run by timerclock(). That is
+ * driven by a one-shot hardware timer programmed for the next expiry,
+ * so timed events get microsecond resolution and do not depend on the
+ * periodic tick; this in turn lets idle cpus stop ticking altogether.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -54,10 +58,66 @@
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * Timer wheel geometry.
+ *
+ * Expiry times are kept in microseconds; the wheel works in units of
+ * 2^WHEEL_SHIFT microseconds. Level 0 has one slot per unit. Each slot
+ * of a higher level covers a whole turn of the level below it, and
+ * its timers are cascaded down when the level below wraps around.
+ *
+ *    level 0: 256 slots of 128us   (32.8ms)
+ *    level 1:  64 slots of 32.8ms  (2.1s)
+ *    level 2:  64 slots of 2.1s    (134s)
+ *    level 3:  64 slots of 134s    (2.4h)
+ *
+ * Timers further out than that wait in the last reachable slot of
+ * level 3 and get refiled when it cascades.
+ */
+#define WHEEL_SHIFT	7
+#define WHEEL_L0_BITS	8
+#define WHEEL_LN_BITS	6
+#define WHEEL_LEVELS	4
+#define WHEEL_L0_SIZE	(1u << WHEEL_L0_BITS)
+#define WHEEL_LN_SIZE	(1u << WHEEL_LN_BITS)
+
+/* First bit of the wheel time that indexes level L (L >= 1) */
+#define WHEEL_LEVEL_SHIFT(l)	(WHEEL_L0_BITS + ((l) - 1) * WHEEL_LN_BITS)
+
+/* Never program the one-shot timer further out than this (usecs). */
+#define ONESHOT_MAX_USECS	1000000
+
+/*
+ * The wheel. Protected by timer_lock.
+ *
+ * wheel_now is the current wheel time: every slot before it has been
+ * run, and the level-0 slot for wheel_now itself may still hold timers
+ * due later within the same unit.
  */
-static struct wchan *lbolt;
-static struct spinlock lbolt_lock;
+static struct spinlock timer_lock;
+static struct timer *wheel0[WHEEL_L0_SIZE];
+static struct timer *wheeln[WHEEL_LEVELS - 1][WHEEL_LN_SIZE];
+static unsigned wheel_count[WHEEL_LEVELS];	/* timers filed per level */
+static uint64_t wheel_now;
+static bool wheel_started;
+
+/* The one-shot event timer, if any, and its current deadline (usecs). */
+static void *oneshot_devdata;
+static void (*oneshot_set)(void *devdata, uint32_t usecs);
+static uint64_t oneshot_deadline;
+
+/*
+ * Sleeping threads wait on one of a few wait channels, hashed by
+ * thread, so a wakeup doesn't rouse every sleeper in the system.
+ */
+#define CLOCK_NSLEEPQ	16
+static struct wchan *sleep_wchans[CLOCK_NSLEEPQ];
+static struct spinlock sleep_lock;
+
+struct clocksleeper {
+	struct timer cs_timer;
+	struct wchan *cs_wchan;
+	volatile bool cs_done;
+};
 
 /*
  * Setup.
@@ -65,29 +125,404 @@ static struct spinlock lbolt_lock;
 void
 hardclock_bootstrap(void)
 {
-	spinlock_init(&lbolt_lock);
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	unsigned i;
+
+	spinlock_init(&timer_lock);
+	spinlock_init(&sleep_lock);
+	for (i=0; i<CLOCK_NSLEEPQ; i++) {
+		sleep_wchans[i] = wchan_create("clocksleep");
+		if (sleep_wchans[i] == NULL) {
+			panic("Couldn't create clocksleep wchan\n");
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Timer wheel
+
+/* Current time in microseconds. */
+static
+uint64_t
+clock_usecs(void)
+{
+	struct timespec ts;
+
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint32_t)ts.tv_nsec / 1000;
+}
+
+/* Convert a timespec to microseconds, rounding up. */
+static
+uint64_t
+timespec_to_usecs(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000 +
+		((uint32_t)ts->tv_nsec + 999) / 1000;
+}
+
+/*
+ * Put a timer in the slot its expiry time belongs to, relative to the
+ * current wheel time. Call with timer_lock held.
+ */
+static
+void
+wheel_file(struct timer *tm)
+{
+	uint64_t when, delta, span;
+	struct timer **slot;
+	unsigned level, shift;
+
+	when = tm->tm_expires >> WHEEL_SHIFT;
+	if (when < wheel_now) {
+		when = wheel_now;
+	}
+	delta = when - wheel_now;
+
+	if (delta < WHEEL_L0_SIZE) {
+		level = 0;
+		slot = &wheel0[when & (WHEEL_L0_SIZE - 1)];
+	}
+	else {
+		for (level = 1; level < WHEEL_LEVELS - 1; level++) {
+			span = (uint64_t)1 << WHEEL_LEVEL_SHIFT(level + 1);
+			if (delta < span) {
+				break;
+			}
+		}
+		shift = WHEEL_LEVEL_SHIFT(level);
+		span = (uint64_t)1 << (shift + WHEEL_LN_BITS);
+		if (delta >= span) {
+			/* Too far out: park it in the furthest slot. */
+			when = wheel_now + span - 1;
+		}
+		slot = &wheeln[level - 1][(when >> shift) & (WHEEL_LN_SIZE - 1)];
+	}
+
+	tm->tm_level = level;
+	tm->tm_next = *slot;
+	if (tm->tm_next != NULL) {
+		tm->tm_next->tm_pprev = &tm->tm_next;
+	}
+	tm->tm_pprev = slot;
+	*slot = tm;
+	wheel_count[level]++;
+}
+
+/* Take a timer out of the wheel. Call with timer_lock held. */
+static
+void
+wheel_unfile(struct timer *tm)
+{
+	KASSERT(tm->tm_pprev != NULL);
+	KASSERT(wheel_count[tm->tm_level] > 0);
+
+	*tm->tm_pprev = tm->tm_next;
+	if (tm->tm_next != NULL) {
+		tm->tm_next->tm_pprev = tm->tm_pprev;
+	}
+	tm->tm_next = NULL;
+	tm->tm_pprev = NULL;
+	wheel_count[tm->tm_level]--;
+}
+
+/*
+ * Level 0 has just wrapped around at wheel_now. Refile the timers of
+ * the slots of the upper levels whose turn has come. Call with
+ * timer_lock held.
+ */
+static
+void
+wheel_cascade(void)
+{
+	struct timer *tm, *list;
+	unsigned level, shift, idx;
+
+	for (level = 1; level < WHEEL_LEVELS; level++) {
+		shift = WHEEL_LEVEL_SHIFT(level);
+		idx = (wheel_now >> shift) & (WHEEL_LN_SIZE - 1);
+
+		list = wheeln[level - 1][idx];
+		while (list != NULL) {
+			tm = list;
+			list = tm->tm_next;
+			wheel_unfile(tm);
+			wheel_file(tm);
+		}
+
+		/* Go up a level only if this one wrapped around too. */
+		if (idx != 0) {
+			break;
+		}
+	}
+}
+
+/*
+ * Move the wheel forward to NOW (usecs), unfiling every timer that
+ * has expired and chaining it onto *EXPIRED. Call with timer_lock
+ * held.
+ */
+static
+void
+wheel_advance(uint64_t now, struct timer **expired)
+{
+	uint64_t target, next;
+	struct timer *tm, *nexttm;
+
+	target = now >> WHEEL_SHIFT;
+	if (target < wheel_now) {
+		/* Clock went backwards (settime?); just run what's due. */
+		target = wheel_now;
+	}
+
+	while (1) {
+		if (wheel_count[0] > 0) {
+			tm = wheel0[wheel_now & (WHEEL_L0_SIZE - 1)];
+			while (tm != NULL) {
+				nexttm = tm->tm_next;
+				if (tm->tm_expires <= now) {
+					wheel_unfile(tm);
+					tm->tm_next = *expired;
+					*expired = tm;
+				}
+				tm = nexttm;
+			}
+		}
+		if (wheel_now == target) {
+			break;
+		}
+
+		if (wheel_count[0] == 0) {
+			/* Nothing in level 0; skip to where it wraps. */
+			next = (wheel_now | (WHEEL_L0_SIZE - 1)) + 1;
+			if (next > target) {
+				wheel_now = target;
+				break;
+			}
+			wheel_now = next;
+		}
+		else {
+			wheel_now++;
+		}
+		if ((wheel_now & (WHEEL_L0_SIZE - 1)) == 0) {
+			wheel_cascade();
+		}
 	}
 }
 
 /*
- * This is called once per second, on one processor, by the timer
- * code.
+ * Return the time (usecs) the wheel next needs attention: either the
+ * earliest level-0 expiry or the next cascade of a nonempty upper
+ * slot, whichever comes first. Returns 0 if the wheel is empty. Call
+ * with timer_lock held.
+ */
+static
+uint64_t
+wheel_next(void)
+{
+	uint64_t best, when;
+	struct timer *tm;
+	unsigned level, shift, idx, i;
+
+	best = 0;
+
+	if (wheel_count[0] > 0) {
+		for (i=0; i<WHEEL_L0_SIZE; i++) {
+			idx = (wheel_now + i) & (WHEEL_L0_SIZE - 1);
+			for (tm = wheel0[idx]; tm != NULL; tm = tm->tm_next) {
+				if (best == 0 || tm->tm_expires < best) {
+					best = tm->tm_expires;
+				}
+			}
+			if (best != 0) {
+				break;
+			}
+		}
+	}
+
+	for (level = 1; level < WHEEL_LEVELS; level++) {
+		if (wheel_count[level] == 0) {
+			continue;
+		}
+		shift = WHEEL_LEVEL_SHIFT(level);
+		for (i=1; i<=WHEEL_LN_SIZE; i++) {
+			idx = ((wheel_now >> shift) + i) & (WHEEL_LN_SIZE - 1);
+			if (wheeln[level - 1][idx] != NULL) {
+				when = (((wheel_now >> shift) + i) << shift)
+					<< WHEEL_SHIFT;
+				if (best == 0 || when < best) {
+					best = when;
+				}
+				break;
+			}
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Make sure the one-shot timer will go off in time for the next thing
+ * the wheel needs to do. Call with timer_lock held.
+ */
+static
+void
+timer_reprogram(uint64_t now)
+{
+	uint64_t next;
+	uint32_t delay;
+
+	if (oneshot_set == NULL) {
+		/* No event timer; hardclock polls us instead. */
+		return;
+	}
+
+	next = wheel_next();
+	if (next == 0) {
+		return;
+	}
+	if (oneshot_deadline != 0 && oneshot_deadline <= next) {
+		/* It's already going to go off soon enough. */
+		return;
+	}
+
+	if (next <= now) {
+		delay = 1;
+	}
+	else if (next - now > ONESHOT_MAX_USECS) {
+		delay = ONESHOT_MAX_USECS;
+	}
+	else {
+		delay = next - now;
+	}
+	oneshot_deadline = now + delay;
+	oneshot_set(oneshot_devdata, delay);
+}
+
+/*
+ * Set up a timer to call FUNC with DATA when it expires.
+ */
+void
+timer_init(struct timer *tm, void (*func)(void *), void *data)
+{
+	tm->tm_next = NULL;
+	tm->tm_pprev = NULL;
+	tm->tm_expires = 0;
+	tm->tm_level = 0;
+	tm->tm_func = func;
+	tm->tm_data = data;
+}
+
+/*
+ * Arm a timer to expire at the absolute time WHEN. The timer must not
+ * already be pending.
+ */
+void
+timer_start(struct timer *tm, const struct timespec *when)
+{
+	uint64_t now;
+
+	spinlock_acquire(&timer_lock);
+	KASSERT(tm->tm_pprev == NULL);
+
+	now = clock_usecs();
+	if (!wheel_started) {
+		wheel_now = now >> WHEEL_SHIFT;
+		wheel_started = true;
+	}
+
+	tm->tm_expires = timespec_to_usecs(when);
+	wheel_file(tm);
+	timer_reprogram(now);
+	spinlock_release(&timer_lock);
+}
+
+/*
+ * Disarm a timer. Returns true if it was pending; false if it had
+ * already expired (its function may be running right now on another
+ * cpu) or had never been started.
+ */
+bool
+timer_stop(struct timer *tm)
+{
+	bool pending;
+
+	spinlock_acquire(&timer_lock);
+	pending = tm->tm_pprev != NULL;
+	if (pending) {
+		wheel_unfile(tm);
+	}
+	spinlock_release(&timer_lock);
+	return pending;
+}
+
+/*
+ * Register the one-shot event timer. SET(DEVDATA, USECS) should make
+ * the device call timerclock() once, USECS microseconds from now,
+ * cancelling any previous countdown.
+ */
+void
+clock_register_oneshot(void *devdata, void (*set)(void *, uint32_t))
+{
+	spinlock_acquire(&timer_lock);
+	KASSERT(oneshot_set == NULL);
+	oneshot_devdata = devdata;
+	oneshot_set = set;
+	spinlock_release(&timer_lock);
+}
+
+/*
+ * True if idle cpus may stop their periodic hardclock, which is the
+ * case once the timer wheel is driven by a one-shot event timer.
+ */
+bool
+clock_tickless_ok(void)
+{
+	return oneshot_set != NULL;
+}
+
+/*
+ * This is called, on one processor, when the one-shot event timer
+ * goes off (or from hardclock if there isn't one). Runs every timer
+ * that has expired, then rearms the event timer.
+ *
+ * The timer functions are called with no locks held but still in
+ * interrupt context, so they must not sleep.
  */
 void
 timerclock(void)
 {
-	/* Just broadcast on lbolt */
-	spinlock_acquire(&lbolt_lock);
-	wchan_wakeall(lbolt, &lbolt_lock);
-	spinlock_release(&lbolt_lock);
+	struct timer *expired, *tm;
+	uint64_t now;
+
+	expired = NULL;
+
+	spinlock_acquire(&timer_lock);
+	if (!wheel_started) {
+		spinlock_release(&timer_lock);
+		return;
+	}
+	oneshot_deadline = 0;
+	now = clock_usecs();
+	wheel_advance(now, &expired);
+	timer_reprogram(now);
+	spinlock_release(&timer_lock);
+
+	while (expired != NULL) {
+		tm = expired;
+		expired = tm->tm_next;
+		tm->tm_next = NULL;
+		tm->tm_func(tm->tm_data);
+	}
 }
 
+////////////////////////////////////////////////////////////
+//
+// hardclock
+
 /*
  * This is called HZ times a second (on each processor) by the timer
- * code.
+ * code, except on cpus that are idle with the tick switched off.
  */
 void
 hardclock(void)
@@ -103,7 +538,57 @@ hardclock(void)
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	thread_yield();
+	if (oneshot_set == NULL && curcpu->c_number == 0) {
+		/* No event timer; poll the timer wheel instead. */
+		timerclock();
+	}
+	if (thread_tick()) {
+		thread_yield();
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Sleeping
+
+static
+void
+clocksleep_wakeup(void *data)
+{
+	struct clocksleeper *cs = data;
+
+	spinlock_acquire(&sleep_lock);
+	cs->cs_done = true;
+	wchan_wakeall(cs->cs_wchan, &sleep_lock);
+	spinlock_release(&sleep_lock);
+}
+
+/*
+ * Suspend execution for the time given by DURATION.
+ */
+void
+clocknanosleep(const struct timespec *duration)
+{
+	struct clocksleeper cs;
+	struct timespec when;
+
+	if (duration->tv_sec == 0 && duration->tv_nsec == 0) {
+		return;
+	}
+
+	timer_init(&cs.cs_timer, clocksleep_wakeup, &cs);
+	cs.cs_wchan = sleep_wchans[((uintptr_t)curthread >> 5) % CLOCK_NSLEEPQ];
+	cs.cs_done = false;
+
+	gettime(&when);
+	timespec_add(&when, duration, &when);
+
+	spinlock_acquire(&sleep_lock);
+	timer_start(&cs.cs_timer, &when);
+	while (!cs.cs_done) {
+		wchan_sleep(cs.cs_wchan, &sleep_lock);
+	}
+	spinlock_release(&sleep_lock);
 }
 
 /*
@@ -112,10 +597,12 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-	spinlock_acquire(&lbolt_lock);
-	while (num_secs > 0) {
-		wchan_sleep(lbolt, &lbolt_lock);
-		num_secs--;
+	struct timespec ts;
+
+	if (num_secs <= 0) {
+		return;
 	}
-	spinlock_release(&lbolt_lock);
+	ts.tv_sec = num_secs;
+	ts.tv_nsec = 0;
+	clocknanosleep(&ts);
 }
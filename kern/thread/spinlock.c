@@ -50,9 +50,15 @@
 void
 spinlock_init(struct spinlock *splk)
 {
-	spinlock_data_set(&splk->splk_lock, 0);
+	spinlock_data_set(&splk->splk_next, 0);
+	spinlock_data_set(&splk->splk_serving, 0);
 	splk->splk_holder = NULL;
 	HANGMAN_LOCKABLEINIT(&splk->splk_hangman, "spinlock");
+#if OPT_LOCKSTAT
+	splk->splk_acquires = 0;
+	splk->splk_contended = 0;
+	splk->splk_spins = 0;
+#endif
 }
 
 /*
@@ -62,7 +68,8 @@ void
 spinlock_cleanup(struct spinlock *splk)
 {
 	KASSERT(splk->splk_holder == NULL);
-	KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+	KASSERT(spinlock_data_get(&splk->splk_next) ==
+		spinlock_data_get(&splk->splk_serving));
 }
 
 /*
@@ -70,12 +77,17 @@ spinlock_cleanup(struct spinlock *splk)
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
  * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * atomic operation to take a ticket and wait for it to be served.
+ * Interrupts staying off while we wait matters more than before: a
+ * ticket, once taken, must be used promptly or everyone queued
+ * behind it waits too.
  */
 void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+	spinlock_data_t ticket;
+	unsigned spins = 0;
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -93,28 +105,27 @@ spinlock_acquire(struct spinlock *splk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&splk->splk_lock) != 0) {
-			continue;
-		}
-		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
-			continue;
-		}
-		break;
+	/*
+	 * Fetch-and-increment hands out tickets in order; the only
+	 * atomic operation is this one per acquire. Then wait, only
+	 * reading, until the holder before us moves splk_serving on.
+	 */
+	ticket = spinlock_data_fetchinc(&splk->splk_next);
+	while (spinlock_data_get(&splk->splk_serving) != ticket) {
+		spins++;
 	}
 
 	membar_store_any();
 	splk->splk_holder = mycpu;
+#if OPT_LOCKSTAT
+	splk->splk_acquires++;
+	if (spins > 0) {
+		splk->splk_contended++;
+		splk->splk_spins += spins;
+	}
+#else
+	(void)spins;
+#endif
 
 	if (CURCPU_EXISTS()) {
 		HANGMAN_ACQUIRE(&curcpu->c_hangman, &splk->splk_hangman);
@@ -137,7 +148,9 @@ spinlock_release(struct spinlock *splk)
 
 	splk->splk_holder = NULL;
 	membar_any_store();
-	spinlock_data_set(&splk->splk_lock, 0);
+	/* only the holder writes splk_serving, so no atomic op needed */
+	spinlock_data_set(&splk->splk_serving,
+			  spinlock_data_get(&splk->splk_serving) + 1);
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -154,3 +167,77 @@ spinlock_do_i_hold(struct spinlock *splk)
 	/* Assume we can read splk_holder atomically enough for this to work */
 	return (splk->splk_holder == curcpu->c_self);
 }
+
+/*
+ * Statistics.
+ */
+
+#if OPT_LOCKSTAT
+
+#define SPINLOCK_NWATCH 16
+
+static struct {
+	struct spinlock *w_lock;
+	const char *w_name;
+} spinlock_watched[SPINLOCK_NWATCH];
+static unsigned spinlock_nwatched;
+static struct spinlock spinlock_watchlock = SPINLOCK_INITIALIZER;
+
+/*
+ * Register a spinlock for printstats. The lock and the name must stay
+ * around for good; meant for the few hot global locks.
+ */
+void
+spinlock_watch(struct spinlock *splk, const char *name)
+{
+	spinlock_acquire(&spinlock_watchlock);
+	if (spinlock_nwatched < SPINLOCK_NWATCH) {
+		spinlock_watched[spinlock_nwatched].w_lock = splk;
+		spinlock_watched[spinlock_nwatched].w_name = name;
+		spinlock_nwatched++;
+	}
+	spinlock_release(&spinlock_watchlock);
+}
+
+void
+spinlock_printstats(void)
+{
+	struct spinlock *splk;
+	uint64_t acq, cont, spins;
+	unsigned i, n;
+
+	spinlock_acquire(&spinlock_watchlock);
+	n = spinlock_nwatched;
+	spinlock_release(&spinlock_watchlock);
+
+	kprintf("%-20s %10s %10s %10s\n", "spinlock", "acquires",
+		"contended", "spins");
+	for (i=0; i<n; i++) {
+		/* entries below n never change once written */
+		splk = spinlock_watched[i].w_lock;
+		spinlock_acquire(splk);
+		acq = splk->splk_acquires;
+		cont = splk->splk_contended;
+		spins = splk->splk_spins;
+		spinlock_release(splk);
+		kprintf("%-20s %10llu %10llu %10llu\n",
+			spinlock_watched[i].w_name, (unsigned long long)acq,
+			(unsigned long long)cont, (unsigned long long)spins);
+	}
+}
+
+#else
+
+void
+spinlock_watch(struct spinlock *splk, const char *name)
+{
+	(void)splk;
+	(void)name;
+}
+
+void
+spinlock_printstats(void)
+{
+}
+
+#endif /* OPT_LOCKSTAT */
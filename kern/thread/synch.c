@@ -37,6 +37,7 @@
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
+#include <cpu.h>
 #include <current.h>
 #include <synch.h>
 
@@ -134,6 +135,174 @@ V(struct semaphore *sem)
 	spinlock_release(&sem->sem_lock);
 }
 
+////////////////////////////////////////////////////////////
+//
+// Lock contention statistics.
+
+#if OPT_LOCKSTAT
+
+#define LOCKSTAT_HASHSIZE 32
+
+struct lockstat {
+	char *ls_name;
+	struct spinlock ls_lock;	/* protects the counters */
+	uint64_t ls_acquires;		/* total acquisitions */
+	uint64_t ls_contended;		/* found the lock held */
+	uint64_t ls_spins;		/* ...and got it by spinning */
+	uint64_t ls_sleeps;		/* ...and had to sleep */
+	struct lockstat *ls_next;
+};
+
+static struct lockstat *lockstat_table[LOCKSTAT_HASHSIZE];
+static struct spinlock lockstat_tablelock = SPINLOCK_INITIALIZER;
+
+static
+unsigned
+lockstat_hash(const char *name)
+{
+	unsigned h = 0;
+
+	while (*name) {
+		h = h*31 + (unsigned char)*name++;
+	}
+	return h % LOCKSTAT_HASHSIZE;
+}
+
+static
+struct lockstat *
+lockstat_find(unsigned h, const char *name)
+{
+	struct lockstat *ls;
+
+	for (ls = lockstat_table[h]; ls != NULL; ls = ls->ls_next) {
+		if (!strcmp(ls->ls_name, name)) {
+			return ls;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Get the (shared) statistics record for locks called NAME, creating
+ * it if needed. Records are never freed, so counters survive the
+ * locks themselves (e.g. one lock per process or vnode). Returns
+ * NULL if out of memory; the lock then just goes uncounted.
+ */
+static
+struct lockstat *
+lockstat_get(const char *name)
+{
+	struct lockstat *ls, *newls;
+	unsigned h;
+
+	h = lockstat_hash(name);
+
+	spinlock_acquire(&lockstat_tablelock);
+	ls = lockstat_find(h, name);
+	spinlock_release(&lockstat_tablelock);
+	if (ls != NULL) {
+		return ls;
+	}
+
+	/* can't kmalloc holding a spinlock */
+	newls = kmalloc(sizeof(*newls));
+	if (newls == NULL) {
+		return NULL;
+	}
+	newls->ls_name = kstrdup(name);
+	if (newls->ls_name == NULL) {
+		kfree(newls);
+		return NULL;
+	}
+	spinlock_init(&newls->ls_lock);
+	newls->ls_acquires = newls->ls_contended = 0;
+	newls->ls_spins = newls->ls_sleeps = 0;
+
+	spinlock_acquire(&lockstat_tablelock);
+	ls = lockstat_find(h, name);
+	if (ls == NULL) {
+		newls->ls_next = lockstat_table[h];
+		lockstat_table[h] = newls;
+		ls = newls;
+		newls = NULL;
+	}
+	spinlock_release(&lockstat_tablelock);
+
+	if (newls != NULL) {
+		/* somebody else got there first */
+		spinlock_cleanup(&newls->ls_lock);
+		kfree(newls->ls_name);
+		kfree(newls);
+	}
+	return ls;
+}
+
+static
+void
+lockstat_count(struct lockstat *ls, bool contended, bool slept)
+{
+	if (ls == NULL) {
+		return;
+	}
+	spinlock_acquire(&ls->ls_lock);
+	ls->ls_acquires++;
+	if (contended) {
+		ls->ls_contended++;
+		if (slept) {
+			ls->ls_sleeps++;
+		}
+		else {
+			ls->ls_spins++;
+		}
+	}
+	spinlock_release(&ls->ls_lock);
+}
+
+void
+lockstat_print(void)
+{
+	struct lockstat *ls;
+	unsigned i;
+
+	kprintf("%-20s %10s %10s %10s %10s\n", "lock", "acquires",
+		"contended", "spun", "slept");
+	/*
+	 * Records are only ever added at the head of a chain, so the
+	 * walk is safe without the table lock; snapshot each record's
+	 * counters under its own lock.
+	 */
+	for (i=0; i<LOCKSTAT_HASHSIZE; i++) {
+		for (ls = lockstat_table[i]; ls != NULL; ls = ls->ls_next) {
+			uint64_t acq, cont, spins, sleeps;
+
+			spinlock_acquire(&ls->ls_lock);
+			acq = ls->ls_acquires;
+			cont = ls->ls_contended;
+			spins = ls->ls_spins;
+			sleeps = ls->ls_sleeps;
+			spinlock_release(&ls->ls_lock);
+
+			kprintf("%-20s %10llu %10llu %10llu %10llu\n",
+				ls->ls_name, (unsigned long long)acq,
+				(unsigned long long)cont,
+				(unsigned long long)spins,
+				(unsigned long long)sleeps);
+		}
+	}
+	kprintf("\n");
+	spinlock_printstats();
+}
+
+#else
+
+void
+lockstat_print(void)
+{
+	kprintf("Lock statistics not configured (options lockstat)\n");
+}
+
+#endif /* OPT_LOCKSTAT */
+
 ////////////////////////////////////////////////////////////
 //
 // Lock.
@@ -170,7 +339,11 @@ lock_create(const char *name)
 	}
 	lock->lk_owner = NULL;
 	spinlock_init(&lock->lk_lock);
+	HANGMAN_LOCKABLEINIT(&lock->lk_hangman, lock->lk_name);
 #endif	
+#if OPT_LOCKSTAT
+	lock->lk_stats = lockstat_get(name);
+#endif
         return lock;
 }
 
@@ -197,6 +370,12 @@ lock_acquire(struct lock *lock)
 {
         // Write this
 #if OPT_SYNCH
+	bool contended = false, slept = false;
+#if !USE_SEMAPHORE_FOR_LOCK
+	struct thread *owner;
+	unsigned spins = 0;
+#endif
+
         KASSERT(lock != NULL);
 	if (lock_do_i_hold(lock)) {
 	  kprintf("AAACKK!\n");
@@ -205,6 +384,9 @@ lock_acquire(struct lock *lock)
 
         KASSERT(curthread->t_in_interrupt == false);
 
+	/* Tell the deadlock detector (options hangman) what we wait for */
+	HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
+
 #if USE_SEMAPHORE_FOR_LOCK
 /*
  *  G.Cabodi - 2019: P BEFORE(!!!) spinlock acquire. OS161 forbids sleeping/realeasing
@@ -217,13 +399,40 @@ lock_acquire(struct lock *lock)
 	spinlock_acquire(&lock->lk_lock);        
 #else
 	spinlock_acquire(&lock->lk_lock);        
+	/*
+	 * Adaptive wait: critical sections are usually short, so while
+	 * the owner is actually running on another cpu it is cheaper to
+	 * spin until it lets go than to pay for two context switches.
+	 * If the owner is not running (or runs on this cpu, where
+	 * spinning would only delay it), or we have spun for too long,
+	 * go to sleep as before. The owner cannot go away under us while
+	 * we hold lk_lock, as it would need lk_lock to release.
+	 */
 	while (lock->lk_owner != NULL) {
+	  contended = true;
+	  owner = (struct thread *)lock->lk_owner;
+	  if (spins < LOCK_SPIN_MAX && owner->t_state == S_RUN &&
+	      owner->t_cpu != curcpu->c_self) {
+	    spinlock_release(&lock->lk_lock);
+	    while (lock->lk_owner == owner && spins < LOCK_SPIN_MAX) {
+	      spins++;
+	    }
+	    spinlock_acquire(&lock->lk_lock);
+	    continue;
+	  }
+	  slept = true;
 	  wchan_sleep(lock->lk_wchan, &lock->lk_lock);
         }
 #endif
         KASSERT(lock->lk_owner == NULL);
         lock->lk_owner=curthread;
 	spinlock_release(&lock->lk_lock);
+	HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
+#if OPT_LOCKSTAT
+	lockstat_count(lock->lk_stats, contended, slept);
+#endif
+	(void)contended;
+	(void)slept;
 #endif
         (void)lock;  // suppress warning until code gets written
 }
@@ -235,6 +444,7 @@ lock_release(struct lock *lock)
 #if OPT_SYNCH
 	KASSERT(lock != NULL);
 	KASSERT(lock_do_i_hold(lock));
+	HANGMAN_RELEASE(&curthread->t_hangman, &lock->lk_hangman);
 	spinlock_acquire(&lock->lk_lock);
         lock->lk_owner=NULL;
 	/*  G.Cabodi - 2019: no problem here owning a spinlock, as V/wchan_wakeone 
@@ -381,4 +591,210 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 #endif
 	(void)cv;    // suppress warning until code gets written
 	(void)lock;  // suppress warning until code gets written
-}
\ No newline at end of file
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(*rw));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rwlock_name = kstrdup(name);
+	if (rw->rwlock_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_rwchan = wchan_create(rw->rwlock_name);
+	if (rw->rw_rwchan == NULL) {
+		goto fail_name;
+	}
+	rw->rw_wwchan = wchan_create(rw->rwlock_name);
+	if (rw->rw_wwchan == NULL) {
+		goto fail_rwchan;
+	}
+	rw->rw_uwchan = wchan_create(rw->rwlock_name);
+	if (rw->rw_uwchan == NULL) {
+		goto fail_wwchan;
+	}
+
+	spinlock_init(&rw->rw_lock);
+	rw->rw_readers = 0;
+	rw->rw_waitwriters = 0;
+	rw->rw_writer = NULL;
+	rw->rw_upgrader = NULL;
+	return rw;
+
+ fail_wwchan:
+	wchan_destroy(rw->rw_wwchan);
+ fail_rwchan:
+	wchan_destroy(rw->rw_rwchan);
+ fail_name:
+	kfree(rw->rwlock_name);
+	kfree(rw);
+	return NULL;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writer == NULL);
+
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_uwchan);
+	wchan_destroy(rw->rw_wwchan);
+	wchan_destroy(rw->rw_rwchan);
+	kfree(rw->rwlock_name);
+	kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	/* writer-preferring: also wait behind sleeping or upgrading writers */
+	while (rw->rw_writer != NULL || rw->rw_waitwriters > 0 ||
+	       rw->rw_upgrader != NULL) {
+		wchan_sleep(rw->rw_rwchan, &rw->rw_lock);
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	rw->rw_readers--;
+	if (rw->rw_upgrader != NULL) {
+		/* the upgrader is itself one of the readers */
+		if (rw->rw_readers == 1) {
+			wchan_wakeone(rw->rw_uwchan, &rw->rw_lock);
+		}
+	}
+	else if (rw->rw_readers == 0) {
+		wchan_wakeone(rw->rw_wwchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	rw->rw_waitwriters++;
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		wchan_sleep(rw->rw_wwchan, &rw->rw_lock);
+	}
+	rw->rw_waitwriters--;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+/*
+ * Hand the lock on: to the next writer if there is one, otherwise to
+ * every waiting reader. Called with rw_lock held and no writer.
+ */
+static
+void
+rwlock_wakeup(struct rwlock *rw)
+{
+	KASSERT(spinlock_do_i_hold(&rw->rw_lock));
+
+	if (rw->rw_waitwriters > 0) {
+		if (rw->rw_readers == 0) {
+			wchan_wakeone(rw->rw_wwchan, &rw->rw_lock);
+		}
+	}
+	else {
+		wchan_wakeall(rw->rw_rwchan, &rw->rw_lock);
+	}
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	rw->rw_writer = NULL;
+	rwlock_wakeup(rw);
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_tryupgrade(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	KASSERT(rw->rw_writer == NULL);
+	if (rw->rw_upgrader != NULL) {
+		spinlock_release(&rw->rw_lock);
+		return false;
+	}
+	/*
+	 * Holding rw_upgrader keeps new readers out; wait for the others
+	 * to drain. Waiting writers also wait for us, since we still
+	 * count as a reader.
+	 */
+	rw->rw_upgrader = curthread;
+	while (rw->rw_readers > 1) {
+		wchan_sleep(rw->rw_uwchan, &rw->rw_lock);
+	}
+	rw->rw_upgrader = NULL;
+	rw->rw_readers = 0;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+	return true;
+}
+
+void
+rwlock_downgrade(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	rw->rw_writer = NULL;
+	rw->rw_readers = 1;
+	/* let in the readers, unless a writer is waiting for us anyway */
+	if (rw->rw_waitwriters == 0) {
+		wchan_wakeall(rw->rw_rwchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	bool ret;
+
+	spinlock_acquire(&rw->rw_lock);
+	ret = rw->rw_writer == curthread;
+	spinlock_release(&rw->rw_lock);
+	return ret;
+}
@@ -48,6 +48,7 @@
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <clock.h>
 #include <mainbus.h>
 #include <vnode.h>
 
@@ -55,6 +56,30 @@
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/*
+ * Multilevel feedback queue tuning. A thread at level L may run for
+ * sched_quantum[L] hardclocks before it is demoted to level L+1. A
+ * thread that waits on a run queue for SCHED_AGING_PERIODS calls of
+ * schedule() is promoted by one level so nothing starves.
+ */
+static const unsigned sched_quantum[SCHED_NLEVELS] = { 1, 2, 4, 8 };
+#define SCHED_AGING_PERIODS	8
+
+/*
+ * Work stealing tuning. A cpu only steals if the victim has at least
+ * SCHED_STEAL_MIN more ready threads than it does, and leaves alone
+ * threads queued on the victim less than SCHED_CACHE_HOT hardclocks
+ * ago, as they probably still have a warm cache there.
+ */
+#define SCHED_STEAL_MIN		2
+#define SCHED_CACHE_HOT		2
+
+/*
+ * Number of exited threads (with their stacks) each cpu keeps around
+ * for thread_fork to reuse instead of going through kmalloc.
+ */
+#define THREAD_CACHE_MAX	16
+
 /* Wait channel. A wchan is protected by an associated, passed-in spinlock. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -69,6 +94,9 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Work stealing, used by the idle loop in thread_switch. */
+static unsigned thread_steal(void);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -108,6 +136,39 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Set up the fields of a new thread, other than its name and stack.
+ * Shared by thread_create and by reuse of cached dead threads.
+ */
+static
+void
+thread_init_fields(struct thread *thread)
+{
+	thread->t_wchan_name = "NEW";
+	thread->t_state = S_READY;
+
+	/* Thread subsystem fields */
+	thread_machdep_init(&thread->t_machdep);
+	threadlistnode_init(&thread->t_listnode, thread);
+	thread->t_context = NULL;
+	thread->t_cpu = NULL;
+	thread->t_proc = NULL;
+	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
+
+	/* Scheduler fields: new threads start at the top level */
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_waitperiods = 0;
+	thread->t_queuedat = 0;
+
+	/* Interrupt state fields */
+	thread->t_in_interrupt = false;
+	thread->t_curspl = IPL_HIGH;
+	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
+
+	/* If you add to struct thread, be sure to initialize here */
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -130,24 +191,8 @@ thread_create(const char *name)
 		kfree(thread);
 		return NULL;
 	}
-	thread->t_wchan_name = "NEW";
-	thread->t_state = S_READY;
-
-	/* Thread subsystem fields */
-	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
 	thread->t_stack = NULL;
-	thread->t_context = NULL;
-	thread->t_cpu = NULL;
-	thread->t_proc = NULL;
-	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
-
-	/* Interrupt state fields */
-	thread->t_in_interrupt = false;
-	thread->t_curspl = IPL_HIGH;
-	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
-
-	/* If you add to struct thread, be sure to initialize here */
+	thread_init_fields(thread);
 
 	return thread;
 }
@@ -165,6 +210,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -177,11 +223,16 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_deadthreads);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_tickless = false;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_migrations = 0;
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
@@ -287,9 +338,69 @@ thread_destroy(struct thread *thread)
 	kfree(thread);
 }
 
+/*
+ * Put a dead thread on this cpu's cache instead of destroying it, if
+ * there is room. Its stack and struct stay allocated and its stack
+ * guard band stays in place; only the name goes. Called at splhigh,
+ * which is what protects c_deadthreads.
+ */
+static
+bool
+thread_cache_put(struct thread *thread)
+{
+	KASSERT(curthread->t_curspl > 0);
+	KASSERT(thread->t_proc == NULL);
+
+	if (thread->t_stack == NULL ||
+	    curcpu->c_deadthreads.tl_count >= THREAD_CACHE_MAX) {
+		return false;
+	}
+	thread_checkstack(thread);
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_machdep_cleanup(&thread->t_machdep);
+	thread->t_wchan_name = "CACHED";
+	kfree(thread->t_name);
+	thread->t_name = NULL;
+	threadlistnode_init(&thread->t_listnode, thread);
+	threadlist_addhead(&curcpu->c_deadthreads, thread);
+	return true;
+}
+
+/*
+ * Get a thread from this cpu's cache, if there is one, and set it up
+ * as thread_create plus a stack would. Returns NULL if the cache is
+ * empty (or we're out of memory for the name).
+ */
+static
+struct thread *
+thread_cache_get(const char *name)
+{
+	struct thread *thread;
+	int spl;
+
+	/* with interrupts off we can't be migrated away from curcpu */
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_deadthreads);
+	splx(spl);
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	thread->t_name = kstrdup(name);
+	if (thread->t_name == NULL) {
+		threadlistnode_cleanup(&thread->t_listnode);
+		kfree(thread->t_stack);
+		kfree(thread);
+		return NULL;
+	}
+	thread_init_fields(thread);
+	return thread;
+}
+
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
- * need to have thread_destroy called on them.)
+ * need to have thread_destroy called on them.) Keep some of them for
+ * reuse.
  *
  * The list of zombies is per-cpu.
  */
@@ -302,7 +413,9 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		if (!thread_cache_put(z)) {
+			thread_destroy(z);
+		}
 	}
 }
 
@@ -314,6 +427,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -328,9 +443,13 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		curcpu->c_runqueue[i].tl_count = 0;
+		curcpu->c_runqueue[i].tl_head.tln_next =
+			&curcpu->c_runqueue[i].tl_tail;
+		curcpu->c_runqueue[i].tl_tail.tln_prev =
+			&curcpu->c_runqueue[i].tl_head;
+	}
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -442,6 +561,72 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Run queue helpers. The caller must hold the cpu's runqueue lock.
+ */
+
+/* Total number of threads on all levels of C's run queue. */
+static
+unsigned
+runqueue_count(struct cpu *c)
+{
+	unsigned i, count;
+
+	count = 0;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		count += c->c_runqueue[i].tl_count;
+	}
+	return count;
+}
+
+/* Put T at the tail of the run queue for its priority level. */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(t->t_priority < SCHED_NLEVELS);
+	t->t_queuedat = c->c_hardclocks;
+	threadlist_addtail(&c->c_runqueue[t->t_priority], t);
+}
+
+/* Take the first thread of the highest nonempty level, or NULL. */
+static
+struct thread *
+runqueue_remnext(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Send IPI_UNIDLE to one tickless idle cpu other than BUSY, so that it
+ * wakes up and steals work. The idle flags are read without locking;
+ * at worst we wake a cpu for nothing or miss one until next time.
+ */
+static
+void
+thread_kick_idle(struct cpu *busy)
+{
+	unsigned i;
+	struct cpu *c;
+
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != busy && c->c_isidle && c->c_tickless) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
 /*
  * Make a thread runnable.
  *
@@ -464,9 +649,22 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
 	}
 
+	/*
+	 * A thread coming back from wchan_sleep gave up the cpu before
+	 * its quantum ran out; boost it by one level and give it a
+	 * fresh quantum so interactive threads stay near the top.
+	 */
+	if (target->t_state == S_SLEEP) {
+		if (target->t_priority > 0) {
+			target->t_priority--;
+		}
+		target->t_ticks = 0;
+	}
+	target->t_waitperiods = 0;
+
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 
 	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
 		/*
@@ -475,6 +673,14 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else if (runqueue_count(targetcpu) >= SCHED_STEAL_MIN) {
+		/*
+		 * Work is piling up. Idle cpus with their hardclock
+		 * off won't come looking for it by themselves, so
+		 * wake one up to steal some.
+		 */
+		thread_kick_idle(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -500,18 +706,22 @@ thread_fork(const char *name,
 	struct thread *newthread;
 	int result;
 
-	newthread = thread_create(name);
+	/* Reuse a dead thread, stack and all, if this cpu has one */
+	newthread = thread_cache_get(name);
 	if (newthread == NULL) {
-		return ENOMEM;
-	}
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
@@ -588,7 +798,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && runqueue_count(curcpu) == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -641,14 +851,34 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remnext(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			/* Try to find work elsewhere before sleeping. */
+			if (thread_steal() == 0) {
+				/*
+				 * Switch off the periodic hardclock if
+				 * the timer system allows it; there's
+				 * nothing for it to do and it just
+				 * keeps waking us up. It is switched
+				 * back on once we have something to
+				 * run.
+				 */
+				if (!curcpu->c_tickless &&
+				    clock_tickless_ok()) {
+					curcpu->c_tickless = true;
+					mainbus_set_hardclock(false);
+				}
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	if (curcpu->c_tickless) {
+		curcpu->c_tickless = false;
+		mainbus_set_hardclock(true);
+	}
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -816,141 +1046,223 @@ thread_yield(void)
 ////////////////////////////////////////////////////////////
 
 /*
- * Scheduler.
+ * Quantum accounting.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is called from hardclock() on every tick. The current thread
+ * is charged one hardclock; once it has used the whole quantum of its
+ * level it is demoted one level and should yield. It should also
+ * yield if a thread of higher priority is waiting on this cpu.
  */
+bool
+thread_tick(void)
+{
+	struct thread *cur = curthread;
+	bool yield;
+	unsigned i;
+
+	/* Ticks taken while idle don't belong to anyone. */
+	if (curcpu->c_isidle) {
+		return false;
+	}
+
+	cur->t_ticks++;
+	if (cur->t_ticks >= sched_quantum[cur->t_priority]) {
+		if (cur->t_priority < SCHED_NLEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		return true;
+	}
+
+	yield = false;
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=0; i<cur->t_priority; i++) {
+		if (!threadlist_isempty(&curcpu->c_runqueue[i])) {
+			yield = true;
+			break;
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+	return yield;
+}
 
+/*
+ * Scheduler.
+ *
+ * This is called periodically from hardclock(). It reshuffles the
+ * current CPU's run queue by job priority: threads that have been
+ * waiting below the top level for SCHED_AGING_PERIODS calls are
+ * promoted by one level, so CPU-bound threads at the bottom still
+ * get to run under a steady stream of interactive work.
+ */
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *t, *next;
+	unsigned level;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (level=1; level<SCHED_NLEVELS; level++) {
+		t = curcpu->c_runqueue[level].tl_head.tln_next->tln_self;
+		while (t != NULL) {
+			next = t->t_listnode.tln_next->tln_self;
+			t->t_waitperiods++;
+			if (t->t_waitperiods >= SCHED_AGING_PERIODS) {
+				threadlist_remove(&curcpu->c_runqueue[level],
+						  t);
+				t->t_priority = level - 1;
+				t->t_ticks = 0;
+				t->t_waitperiods = 0;
+				runqueue_add(curcpu->c_self, t);
+			}
+			t = next;
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
 }
 
 /*
  * Thread migration.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * Migration is pull-based: a cpu that is idle, or less busy than some
+ * other cpu, steals ready threads from the busiest run queue. Only
+ * the stealer's and the victim's run queues are locked, so the cost
+ * does not grow with the number of cpus beyond an unlocked scan of
+ * the queue lengths.
  *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
+ * which is fairly slow. System/161 does not (yet) model such cache
+ * effects, but we still leave recently queued threads where they are
+ * (SCHED_CACHE_HOT) and only steal when the imbalance is at least
+ * SCHED_STEAL_MIN, so that threads don't ping-pong between cpus.
+ */
+
+/*
+ * Steal half the excess ready threads of the busiest other cpu onto
+ * our own run queue. Returns the number of threads stolen.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * The busiest cpu is picked by reading the other run queue lengths
+ * without locking them; this is only a hint, and is rechecked once
+ * both locks are held.
  */
-void
-thread_consider_migration(void)
+static
+unsigned
+thread_steal(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	struct cpu *self, *victim, *c, *first, *second;
+	struct thread *t, *next;
+	unsigned i, numcpus, count, best, mine, to_steal, stolen, level;
 
-	my_count = total_count = 0;
+	self = curcpu->c_self;
 	numcpus = cpuarray_num(&allcpus);
+
+	victim = NULL;
+	best = 0;
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+		if (c == self) {
+			continue;
+		}
+		count = runqueue_count(c);
+		if (count > best) {
+			best = count;
+			victim = c;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
-
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+	if (victim == NULL || best < SCHED_STEAL_MIN) {
+		return 0;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	/* Always lock run queues in cpu number order. */
+	if (self->c_number < victim->c_number) {
+		first = self;
+		second = victim;
 	}
-	spinlock_release(&curcpu->c_runqueue_lock);
+	else {
+		first = victim;
+		second = self;
+	}
+	spinlock_acquire(&first->c_runqueue_lock);
+	spinlock_acquire(&second->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
+	stolen = 0;
+	mine = runqueue_count(self);
+	count = runqueue_count(victim);
+	if (count >= mine + SCHED_STEAL_MIN) {
+		to_steal = (count - mine) / 2;
 
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
+		/*
+		 * Start from the lowest priority level: those are the
+		 * CPU-bound threads, which gain the most from a cpu of
+		 * their own and lose the least from a cold cache.
+		 */
+		for (level = SCHED_NLEVELS; level-- > 0 && stolen < to_steal;) {
+			t = victim->c_runqueue[level].tl_head.tln_next->tln_self;
+			while (t != NULL && stolen < to_steal) {
+				next = t->t_listnode.tln_next->tln_self;
 				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
+				 * Ordinarily, curthread will not appear on
+				 * the run queue. However, it can if it went
+				 * to sleep, the processor became idle (so it
+				 * remained curthread), and it was then woken
+				 * before the processor fully unidled.
+				 * Migrating it would be a disaster, so skip
+				 * it, along with anything still cache-hot.
 				 */
-				ipi_send(c, IPI_UNIDLE);
+				if (t != victim->c_curthread &&
+				    victim->c_hardclocks - t->t_queuedat
+				    >= SCHED_CACHE_HOT) {
+					threadlist_remove(
+						&victim->c_runqueue[level], t);
+					t->t_cpu = self;
+					runqueue_add(self, t);
+					DEBUG(DB_THREADS,
+					      "Migrated thread %s: cpu %u -> %u",
+					      t->t_name, victim->c_number,
+					      self->c_number);
+					stolen++;
+				}
+				t = next;
 			}
 		}
-		spinlock_release(&c->c_runqueue_lock);
+		self->c_migrations += stolen;
 	}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
-	}
+	spinlock_release(&second->c_runqueue_lock);
+	spinlock_release(&first->c_runqueue_lock);
+
+	return stolen;
+}
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+/*
+ * This is called periodically from hardclock(). If some other cpu is
+ * noticeably busier than this one, pull some of its threads over.
+ * (Idle cpus also do this each time they look for work, in
+ * thread_switch.)
+ */
+void
+thread_consider_migration(void)
+{
+	(void)thread_steal();
+}
+
+/*
+ * Print per-cpu scheduler statistics. The numbers are read without
+ * locking and are only approximate.
+ */
+void
+cpu_printstats(void)
+{
+	unsigned i;
+	struct cpu *c;
+
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		kprintf("cpu%u: %u hardclocks, %u ready, %u migrations in\n",
+			c->c_number, c->c_hardclocks, runqueue_count(c),
+			c->c_migrations);
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -90,7 +90,11 @@ DEFARRAY(knowndev, static __UNUSED inline);
 
 static struct knowndevarray *knowndevs;
 
-/* The big lock for all FS ops. Remove for filesystem assignment. */
+/*
+ * The lock for the mount table (knowndevs) and bootfs, also held
+ * across mount, unmount, and global sync. Filesystems do their own
+ * locking for everything else; see sfs.h for SFS.
+ */
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
 
@@ -112,6 +116,8 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	vfs_ncache_bootstrap();
+
 	devnull_create();
 	semfs_bootstrap();
 }
@@ -654,6 +660,9 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* drop cached names, which hold vnodes on the fs */
+	vfs_ncache_purgefs(kd->kd_fs);
+
 	/* sync the fs */
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
@@ -745,6 +754,8 @@ vfs_unmountall(void)
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		vfs_ncache_purgefs(dev->kd_fs);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
@@ -42,6 +42,334 @@
 
 static struct vnode *bootfs_vnode = NULL;
 
+////////////////////////////////////////////////////////////
+//
+// Name cache
+//
+// Maps (directory vnode, name) to the vnode the name refers to, or
+// to nothing for a name known not to exist. Path lookups are done a
+// component at a time through the cache, so a repeated lookup of the
+// same path doesn't call into the filesystem at all.
+//
+// Each entry holds a reference to its directory and, if positive,
+// to the vnode the name refers to, so neither can be reclaimed (and
+// its address reused) while the entry exists; files found through
+// the cache thus stay loaded while they are cached. Entries are
+// invalidated by the operations in vfspath.c that create or remove
+// names, and all of a filesystem's entries are dropped before it is
+// unmounted.
+//
+// A lookup that misses calls VOP_LOOKUP without any lock that keeps
+// the name from being created or removed meanwhile. So every
+// invalidation bumps vfs_ncgen, and the result is only entered if
+// the generation is the same as before the VOP_LOOKUP; otherwise it
+// may already be stale.
+//
+// The cache is a fixed pool of entries, hashed by (directory, name)
+// and recycled in LRU order. Long names, "." and ".." aren't cached.
+//
+// Lock ordering: vfs_nclock is taken after vfs_biglock, and no VOP is
+// called with it held, so it is unordered with respect to any
+// filesystem's own locks.
+
+#define VFS_NC_SIZE	256	/* Entries */
+#define VFS_NC_HASHSIZE	64	/* Hash buckets */
+#define VFS_NC_NAMELEN	32	/* Longest cached name, plus one */
+
+struct vfs_ncentry {
+	struct vnode *nc_dir;		/* Directory, or NULL if unused */
+	struct vnode *nc_vn;		/* Result, or NULL if negative */
+	char nc_name[VFS_NC_NAMELEN];
+	struct vfs_ncentry *nc_hashnext;
+	struct vfs_ncentry *nc_lruprev;	/* Most recent first */
+	struct vfs_ncentry *nc_lrunext;
+};
+
+static struct lock *vfs_nclock;
+static unsigned vfs_ncgen;		/* Bumped by every invalidation */
+static struct vfs_ncentry vfs_ncpool[VFS_NC_SIZE];
+static struct vfs_ncentry *vfs_nchash[VFS_NC_HASHSIZE];
+static struct vfs_ncentry *vfs_nclru_head, *vfs_nclru_tail;
+
+static
+unsigned
+vfs_nc_hashfn(struct vnode *dir, const char *name)
+{
+	unsigned h = (uintptr_t)dir >> 4;
+
+	while (*name != 0) {
+		h = h * 33 + (unsigned char)*name++;
+	}
+	return h % VFS_NC_HASHSIZE;
+}
+
+static
+void
+vfs_nc_lruremove(struct vfs_ncentry *e)
+{
+	if (e->nc_lruprev != NULL) {
+		e->nc_lruprev->nc_lrunext = e->nc_lrunext;
+	}
+	else {
+		vfs_nclru_head = e->nc_lrunext;
+	}
+	if (e->nc_lrunext != NULL) {
+		e->nc_lrunext->nc_lruprev = e->nc_lruprev;
+	}
+	else {
+		vfs_nclru_tail = e->nc_lruprev;
+	}
+	e->nc_lruprev = e->nc_lrunext = NULL;
+}
+
+static
+void
+vfs_nc_lrufront(struct vfs_ncentry *e)
+{
+	e->nc_lruprev = NULL;
+	e->nc_lrunext = vfs_nclru_head;
+	if (vfs_nclru_head != NULL) {
+		vfs_nclru_head->nc_lruprev = e;
+	}
+	else {
+		vfs_nclru_tail = e;
+	}
+	vfs_nclru_head = e;
+}
+
+static
+void
+vfs_nc_lruback(struct vfs_ncentry *e)
+{
+	e->nc_lrunext = NULL;
+	e->nc_lruprev = vfs_nclru_tail;
+	if (vfs_nclru_tail != NULL) {
+		vfs_nclru_tail->nc_lrunext = e;
+	}
+	else {
+		vfs_nclru_head = e;
+	}
+	vfs_nclru_tail = e;
+}
+
+/*
+ * Find the entry for (DIR, NAME). Call with vfs_nclock held.
+ */
+static
+struct vfs_ncentry *
+vfs_nc_find(struct vnode *dir, const char *name)
+{
+	struct vfs_ncentry *e;
+
+	for (e = vfs_nchash[vfs_nc_hashfn(dir, name)]; e != NULL;
+	     e = e->nc_hashnext) {
+		if (e->nc_dir == dir && !strcmp(e->nc_name, name)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take an entry out of use and move it to the end of the LRU list.
+ * Hands back the references it held in *DIRP and *VNP, which the
+ * caller must drop with vfs_nc_release after releasing vfs_nclock.
+ * Call with vfs_nclock held.
+ */
+static
+void
+vfs_nc_drop(struct vfs_ncentry *e, struct vnode **dirp, struct vnode **vnp)
+{
+	struct vfs_ncentry **pp;
+
+	KASSERT(e->nc_dir != NULL);
+
+	pp = &vfs_nchash[vfs_nc_hashfn(e->nc_dir, e->nc_name)];
+	while (*pp != e) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->nc_hashnext;
+	}
+	*pp = e->nc_hashnext;
+	e->nc_hashnext = NULL;
+
+	*dirp = e->nc_dir;
+	*vnp = e->nc_vn;
+	e->nc_dir = NULL;
+	e->nc_vn = NULL;
+	vfs_nc_lruremove(e);
+	vfs_nc_lruback(e);
+}
+
+/*
+ * Drop the references handed back by vfs_nc_drop.
+ */
+static
+void
+vfs_nc_release(struct vnode *dir, struct vnode *vn)
+{
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+}
+
+/*
+ * Set up the name cache. Called from vfs_bootstrap.
+ */
+void
+vfs_ncache_bootstrap(void)
+{
+	unsigned i;
+
+	vfs_nclock = lock_create("vfs_nc");
+	if (vfs_nclock == NULL) {
+		panic("vfs: Could not create name cache lock\n");
+	}
+	for (i=0; i<VFS_NC_SIZE; i++) {
+		vfs_ncpool[i].nc_dir = NULL;
+		vfs_ncpool[i].nc_vn = NULL;
+		vfs_ncpool[i].nc_hashnext = NULL;
+		vfs_nc_lruback(&vfs_ncpool[i]);
+	}
+}
+
+/*
+ * Look up (DIR, NAME) in the cache. Returns false on a miss, with
+ * the current generation in *GEN to pass to vfs_nc_enter. On a hit,
+ * sets *RESULT to 0 and hands back a new reference in *RET, or sets
+ * *RESULT to ENOENT for a negative entry.
+ */
+static
+bool
+vfs_nc_lookup(struct vnode *dir, const char *name, int *result,
+	      struct vnode **ret, unsigned *gen)
+{
+	struct vfs_ncentry *e;
+
+	lock_acquire(vfs_nclock);
+	e = vfs_nc_find(dir, name);
+	if (e == NULL) {
+		*gen = vfs_ncgen;
+		lock_release(vfs_nclock);
+		return false;
+	}
+	vfs_nc_lruremove(e);
+	vfs_nc_lrufront(e);
+	if (e->nc_vn == NULL) {
+		*result = ENOENT;
+	}
+	else {
+		VOP_INCREF(e->nc_vn);
+		*ret = e->nc_vn;
+		*result = 0;
+	}
+	lock_release(vfs_nclock);
+	return true;
+}
+
+/*
+ * Record that NAME in DIR is VN (NULL if it doesn't exist), as found
+ * by a VOP_LOOKUP started at generation GEN. Nothing is recorded if
+ * anything has been invalidated since.
+ */
+static
+void
+vfs_nc_enter(struct vnode *dir, const char *name, struct vnode *vn,
+	     unsigned gen)
+{
+	struct vfs_ncentry *e;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	KASSERT(strlen(name) < VFS_NC_NAMELEN);
+
+	lock_acquire(vfs_nclock);
+	if (gen != vfs_ncgen) {
+		/* The name may have changed under the lookup */
+		lock_release(vfs_nclock);
+		return;
+	}
+	e = vfs_nc_find(dir, name);
+	if (e != NULL) {
+		/* Someone else got here first */
+		lock_release(vfs_nclock);
+		return;
+	}
+
+	e = vfs_nclru_tail;
+	if (e->nc_dir != NULL) {
+		vfs_nc_drop(e, &olddir, &oldvn);
+	}
+	VOP_INCREF(dir);
+	e->nc_dir = dir;
+	e->nc_vn = vn;
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	strcpy(e->nc_name, name);
+	e->nc_hashnext = vfs_nchash[vfs_nc_hashfn(dir, name)];
+	vfs_nchash[vfs_nc_hashfn(dir, name)] = e;
+	vfs_nc_lruremove(e);
+	vfs_nc_lrufront(e);
+	lock_release(vfs_nclock);
+
+	vfs_nc_release(olddir, oldvn);
+}
+
+/*
+ * Forget NAME in DIR; called after anything that may have created,
+ * removed, or replaced it.
+ */
+void
+vfs_ncache_remove(struct vnode *dir, const char *name)
+{
+	struct vfs_ncentry *e;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	lock_acquire(vfs_nclock);
+	vfs_ncgen++;
+	e = vfs_nc_find(dir, name);
+	if (e != NULL) {
+		vfs_nc_drop(e, &olddir, &oldvn);
+	}
+	lock_release(vfs_nclock);
+
+	vfs_nc_release(olddir, oldvn);
+}
+
+/*
+ * Drop every entry belonging to filesystem FS, so the vnodes they
+ * hold can be reclaimed before it is unmounted.
+ */
+void
+vfs_ncache_purgefs(struct fs *fs)
+{
+	struct vfs_ncentry *e;
+	struct vnode *olddir, *oldvn;
+	unsigned i;
+
+	do {
+		olddir = oldvn = NULL;
+		lock_acquire(vfs_nclock);
+		vfs_ncgen++;
+		for (i=0; i<VFS_NC_SIZE; i++) {
+			e = &vfs_ncpool[i];
+			if (e->nc_dir == NULL) {
+				continue;
+			}
+			if (e->nc_dir->vn_fs == fs ||
+			    (e->nc_vn != NULL && e->nc_vn->vn_fs == fs)) {
+				vfs_nc_drop(e, &olddir, &oldvn);
+				break;
+			}
+		}
+		lock_release(vfs_nclock);
+
+		vfs_nc_release(olddir, oldvn);
+	} while (olddir != NULL);
+}
+
 /*
  * Helper function for actually changing bootfs_vnode.
  */
@@ -234,6 +562,62 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	return 0;
 }
 
+/*
+ * Look up PATH relative to DIR a component at a time, going through
+ * the name cache. Consumes the caller's reference to DIR. Components
+ * the cache can't hold ("." and "..", or names too long to cache)
+ * hand the rest of the path to the filesystem in one go, as before.
+ */
+static
+int
+vfs_lookup_walk(struct vnode *dir, char *path, struct vnode **retval)
+{
+	char name[VFS_NC_NAMELEN];
+	struct vnode *vn;
+	size_t len;
+	unsigned gen;
+	int result;
+
+	while (1) {
+		while (*path == '/') {
+			path++;
+		}
+		if (*path == 0) {
+			*retval = dir;
+			return 0;
+		}
+
+		for (len = 0; path[len] != 0 && path[len] != '/'; len++) {
+			/* nothing */
+		}
+		if (len >= sizeof(name) ||
+		    (path[0] == '.' && (len == 1 ||
+					(len == 2 && path[1] == '.')))) {
+			result = VOP_LOOKUP(dir, path, retval);
+			VOP_DECREF(dir);
+			return result;
+		}
+		memcpy(name, path, len);
+		name[len] = 0;
+		path += len;
+
+		if (!vfs_nc_lookup(dir, name, &result, &vn, &gen)) {
+			result = VOP_LOOKUP(dir, name, &vn);
+			if (result == 0) {
+				vfs_nc_enter(dir, name, vn, gen);
+			}
+			else if (result == ENOENT) {
+				vfs_nc_enter(dir, name, NULL, gen);
+			}
+		}
+		VOP_DECREF(dir);
+		if (result) {
+			return result;
+		}
+		dir = vn;
+	}
+}
+
 /*
  * Name-to-vnode translation.
  * (In BSD, both of these are subsumed by namei().)
@@ -244,13 +628,14 @@ vfs_lookparent(char *path, struct vnode **retval,
 	       char *buf, size_t buflen)
 {
 	struct vnode *startvn;
+	char *last;
 	int result;
 
+	/* vfs_biglock covers the mount table and bootfs, not the walk */
 	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
+	vfs_biglock_release();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -263,12 +648,26 @@ vfs_lookparent(char *path, struct vnode **retval,
 		result = EINVAL;
 	}
 	else {
+		/*
+		 * Walk everything up to the last component through
+		 * the name cache; the filesystem does the last step.
+		 * (A trailing slash, or no slash at all, leaves the
+		 * whole thing to the filesystem.)
+		 */
+		last = strrchr(path, '/');
+		if (last != NULL && last[1] != 0) {
+			*last = 0;
+			result = vfs_lookup_walk(startvn, path, &startvn);
+			if (result) {
+				return result;
+			}
+			path = last + 1;
+		}
 		result = VOP_LOOKPARENT(startvn, path, retval, buf, buflen);
 	}
 
 	VOP_DECREF(startvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -279,22 +678,17 @@ vfs_lookup(char *path, struct vnode **retval)
 	int result;
 
 	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
+	vfs_biglock_release();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
-	result = VOP_LOOKUP(startvn, path, retval);
-
-	VOP_DECREF(startvn);
-	vfs_biglock_release();
-	return result;
+	/* This consumes our reference to startvn */
+	return vfs_lookup_walk(startvn, path, retval);
 }
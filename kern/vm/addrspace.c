@@ -68,7 +68,7 @@ struct addrspace *as_create(void)
 	as->stack_limit = 0;
 	as->pt_l1 = NULL;
 	as->pt_l1_entries = 0;
-	as->pt_lock = lock_create("aspt");
+	as->pt_lock = rwlock_create("aspt");
 
 	if (!as->pt_lock)
 	{
@@ -111,7 +111,7 @@ void as_destroy(struct addrspace *as)
 		/* Proteggiamo L1/L2 durante la scansione */
 		if (as->pt_lock)
 		{
-			lock_acquire(as->pt_lock);
+			rwlock_acquire_write(as->pt_lock);
 		}
 
 		for (unsigned i = 0; i < as->pt_l1_entries; i++)
@@ -147,7 +147,7 @@ void as_destroy(struct addrspace *as)
 
 		if (as->pt_lock)
 		{
-			lock_release(as->pt_lock);
+			rwlock_release_write(as->pt_lock);
 		}
 	}
 
@@ -171,7 +171,7 @@ void as_destroy(struct addrspace *as)
 	/* 4) Distruggi il lock della PT */
 	if (as->pt_lock)
 	{
-		lock_destroy(as->pt_lock);
+		rwlock_destroy(as->pt_lock);
 		as->pt_lock = NULL;
 	}
 #endif
@@ -91,6 +91,8 @@ void coremap_bootstrap(void)
     /* Inizializza il contatore delle pagine libere */
     cm_free_count = cm_nframes - fixed_frames;
 
+    spinlock_watch(&cm_lock, "coremap");
+
     cm_ready = 1;
     kprintf("[PAGING] coremap: %lu frames, %lu fixed, %lu free\n",
             cm_nframes, fixed_frames, cm_nframes - fixed_frames);
@@ -101,6 +103,15 @@ int coremap_is_ready(void)
     return cm_ready;
 }
 
+/* Numero totale di frame e frame liberi (istantanea, senza garanzie) */
+void coremap_getstats(unsigned long *nframes, unsigned long *nfree)
+{
+    spinlock_acquire(&cm_lock);
+    *nframes = cm_nframes;
+    *nfree = cm_free_count;
+    spinlock_release(&cm_lock);
+}
+
 /* Cerca il primo blocco contiguo di npages FREE (first-fit) */
 paddr_t
 coremap_alloc_npages(unsigned long npages)
@@ -169,6 +169,16 @@ struct pageref
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
+/*
+ * Called once early in boot. The allocator itself needs no setup; this
+ * just hooks its lock into the lock statistics.
+ */
+void
+kheap_bootstrap(void)
+{
+	spinlock_watch(&kmalloc_spinlock, "kmalloc");
+}
+
 ////////////////////////////////////////
 
 /*
@@ -63,6 +63,7 @@ void pt_destroy(struct addrspace *as)
     as->pt_l1_entries = 0;
 }
 
+/* Solo lettura di L1/L2: il chiamante tiene pt_lock almeno in lettura */
 struct pte *
 pt_lookup(struct addrspace *as, vaddr_t va)
 {
@@ -99,7 +100,7 @@ pt_lookup_create(struct addrspace *as, vaddr_t va)
         bzero(newl2, sizeof(struct pte) * PT_L2_SIZE);
 
         /* pubblica con lock per evitare race tra thread dello stesso proc */
-        lock_acquire(as->pt_lock);
+        rwlock_acquire_write(as->pt_lock);
         if (as->pt_l1[i1] == NULL)
         {
             as->pt_l1[i1] = newl2;
@@ -110,7 +111,7 @@ pt_lookup_create(struct addrspace *as, vaddr_t va)
         {
             l2 = (struct pte *)as->pt_l1[i1];
         }
-        lock_release(as->pt_lock);
+        rwlock_release_write(as->pt_lock);
         if (newl2)
             kfree(newl2); /* qualcun altro l’ha messa */
     }
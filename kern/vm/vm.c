@@ -109,12 +109,12 @@ evict_and_reuse_frame(struct addrspace *newas, vaddr_t newva, paddr_t *out_pa)
         /* PTE del “vecchio” proprietario */
         struct pte *opte = NULL;
         if (oas->pt_lock)
-            lock_acquire(oas->pt_lock);
+            rwlock_acquire_write(oas->pt_lock);
         opte = pt_lookup(oas, ova);
         if (!opte || opte->state != PTE_INRAM || opte->paddr != cand)
         {
             if (oas->pt_lock)
-                lock_release(oas->pt_lock);
+                rwlock_release_write(oas->pt_lock);
             continue; /* già cambiata o non corrisponde */
         }
 
@@ -134,7 +134,7 @@ evict_and_reuse_frame(struct addrspace *newas, vaddr_t newva, paddr_t *out_pa)
             opte->state = PTE_NOTPRESENT;
             opte->paddr = 0;
             if (oas->pt_lock)
-                lock_release(oas->pt_lock);
+                rwlock_release_write(oas->pt_lock);
 
             /* Riusa subito il frame per il nuovo fault */
             coremap_set_owner(cand, newas, newva_aligned);
@@ -150,7 +150,7 @@ evict_and_reuse_frame(struct addrspace *newas, vaddr_t newva, paddr_t *out_pa)
             {
                 /* Se lo swap è pieno o errore I/O: prova altro candidato */
                 if (oas->pt_lock)
-                    lock_release(oas->pt_lock);
+                    rwlock_release_write(oas->pt_lock);
                 continue;
             }
 
@@ -159,7 +159,7 @@ evict_and_reuse_frame(struct addrspace *newas, vaddr_t newva, paddr_t *out_pa)
             opte->swapid = slot;
             opte->paddr = 0;
             if (oas->pt_lock)
-                lock_release(oas->pt_lock);
+                rwlock_release_write(oas->pt_lock);
 
             vmstats_inc_swapfile_writes();
 
@@ -225,25 +225,33 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
         return EFAULT;
     }
 
-    /* PTE (crea L2 se manca) */
-    struct pte *pte = pt_lookup_create(as, va);
-    if (pte == NULL)
-        return ENOMEM;
-
-    /* 1) PTE già in RAM -> solo reload TLB */
-    if (pte->state == PTE_INRAM)
+    /* 1) PTE già in RAM -> solo reload TLB.
+     * Caso più frequente: basta il lock della PT in lettura, così i
+     * reload di più thread dello stesso processo non si serializzano.
+     * Il TLB va caricato prima di rilasciare il lock, altrimenti un
+     * eviction concorrente potrebbe riusare il frame nel frattempo. */
+    rwlock_acquire_read(as->pt_lock);
+    struct pte *pte = pt_lookup(as, va);
+    if (pte != NULL && pte->state == PTE_INRAM)
     {
         int used_free = 0;
         vmstats_inc_tlb_faults();
         vmstats_inc_tlb_reloads();
 
         (void)tlb_insert_rr(va, pte->paddr, (pte->perms & PTE_PERM_W) != 0, &used_free);
+        rwlock_release_read(as->pt_lock);
         if (used_free)
             vmstats_inc_tlb_faults_with_free();
         else
             vmstats_inc_tlb_faults_with_replace();
         return 0;
     }
+    rwlock_release_read(as->pt_lock);
+
+    /* PTE (crea L2 se manca) */
+    pte = pt_lookup_create(as, va);
+    if (pte == NULL)
+        return ENOMEM;
 
     /* 2) Pagina nello swap -> swap-in (con fallback eviction se no frame liberi) */
     if (pte->state == PTE_INSWAP)
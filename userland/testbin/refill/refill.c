@@ -0,0 +1,104 @@
+/*
+ * refill.c
+ *
+ * 	Tests that space freed by removing a file can be used again
+ * 	right away, by filling the file system, removing the file
+ * 	that filled it, and at once writing another.
+ *
+ * SFS holds freed blocks back until a sync has written out the
+ * metadata that stopped using them, so this makes sure a writer
+ * that runs out of space while blocks are held back gets them
+ * instead of an error.
+ *
+ * This should run correctly when the file system assignment is complete.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#define FILLER		"refill.fill"
+#define SECOND		"refill.again"
+#define CHUNK		4096
+
+static char buf[CHUNK];
+
+int
+main(void)
+{
+	int fd, fd2, r;
+	off_t filled, written;
+
+	memset(buf, 'x', sizeof(buf));
+
+	/*
+	 * Create the second file first: making it once the disk is
+	 * full could fail for want of space for its inode.
+	 */
+	fd2 = open(SECOND, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+	if (fd2 < 0) {
+		err(1, "%s", SECOND);
+	}
+
+	fd = open(FILLER, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", FILLER);
+	}
+
+	/* fill the disk */
+	filled = 0;
+	while (1) {
+		r = write(fd, buf, sizeof(buf));
+		if (r < 0) {
+			if (errno != ENOSPC) {
+				err(1, "%s: write", FILLER);
+			}
+			break;
+		}
+		if (r == 0) {
+			break;
+		}
+		filled += r;
+	}
+	close(fd);
+	printf("Filled the disk with %lld bytes\n", (long long)filled);
+	if (filled < 2*CHUNK) {
+		remove(FILLER);
+		remove(SECOND);
+		errx(1, "Not enough space to test with");
+	}
+
+	if (remove(FILLER)) {
+		err(1, "%s: remove", FILLER);
+	}
+
+	/* now write half as much again, without waiting for anything */
+	written = 0;
+	while (written < filled / 2) {
+		r = write(fd2, buf, sizeof(buf));
+		if (r < 0) {
+			warn("%s: write after %lld bytes", SECOND,
+			     (long long)written);
+			break;
+		}
+		if (r < (int)sizeof(buf)) {
+			warnx("%s: short write after %lld bytes", SECOND,
+			      (long long)written);
+			break;
+		}
+		written += r;
+	}
+	close(fd2);
+	remove(SECOND);
+
+	if (written < filled / 2) {
+		errx(1, "Failed: freed space could not be reused");
+	}
+
+	printf("Succeeded!\n");
+
+	return 0;
+}